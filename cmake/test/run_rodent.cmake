@@ -2,7 +2,17 @@ execute_process(COMMAND ${RODENT} --bench 50 -o ${CMAKE_CURRENT_BINARY_DIR}/${RO
 if (CMD_RESULT)
     message(FATAL_ERROR "Error running rodent")
 endif()
-execute_process(COMMAND ${IM_COMPARE} -metric MSE ${TESTING_DIR}/ref-cornell.png ${RODENT_OUTPUT}.png ${RODENT_OUTPUT}-diff.png RESULT_VARIABLE CMD_RESULT)
-if (CMD_RESULT)
-    message(FATAL_ERROR "The output of rodent '${RODENT_OUTPUT}.png' does not match the reference '${TESTING_DIR}/ref-cornell.png'")
+# REF_IMAGE is the reference image, and MAX_RMSE the largest normalized RMSE accepted between
+# the output and the reference (an exact match is required when it is not set)
+if (NOT DEFINED MAX_RMSE)
+    set(MAX_RMSE 0)
+endif()
+execute_process(COMMAND ${IM_COMPARE} -metric RMSE ${REF_IMAGE} ${RODENT_OUTPUT}.png ${RODENT_OUTPUT}-diff.png RESULT_VARIABLE CMD_RESULT ERROR_VARIABLE CMD_ERROR)
+# compare prints the absolute and normalized errors as "<error> (<normalized error>)", and returns 2 on failure
+if (CMD_RESULT GREATER 1 OR NOT CMD_ERROR MATCHES "\\(([0-9.eE+-]+)\\)")
+    message(FATAL_ERROR "Error comparing '${RODENT_OUTPUT}.png' with the reference: ${CMD_ERROR}")
+endif()
+set(RMSE ${CMAKE_MATCH_1})
+if (RMSE GREATER MAX_RMSE)
+    message(FATAL_ERROR "The output of rodent '${RODENT_OUTPUT}.png' does not match the reference '${REF_IMAGE}' (RMSE ${RMSE}, at most ${MAX_RMSE} accepted)")
 endif()
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
+
 #include "runtime/float3.h"
 
 static constexpr float pi = 3.14159265359f;
@@ -43,4 +46,37 @@ struct Camera {
     inline void move(float x, float y, float z) {
         eye += right * x + up * y + dir * z;
     }
-};
\ No newline at end of file
+};
+
+/// Camera position and orientation, as stored in pose files (one pose per line: eye, dir and up vectors).
+struct CameraPose {
+    float3 Eye = float3(0,0,0);
+    float3 Dir = float3(0,0,1);
+    float3 Up  = float3(0,1,0);
+
+    inline CameraPose() = default;
+    inline explicit CameraPose(const Camera& cam)
+        : Eye(cam.eye)
+        , Dir(cam.dir)
+        , Up(cam.up)
+    {}
+
+    inline void apply(Camera& cam) const {
+        cam.eye = Eye;
+        cam.update_dir(Dir, Up);
+    }
+};
+
+inline CameraPose read_pose(std::istream& in) {
+    CameraPose pose;
+    in >> pose.Eye[0] >> pose.Eye[1] >> pose.Eye[2];
+    in >> pose.Dir[0] >> pose.Dir[1] >> pose.Dir[2];
+    in >> pose.Up[0] >> pose.Up[1] >> pose.Up[2];
+    return pose;
+}
+
+inline void write_pose(const CameraPose& pose, std::ostream& out) {
+    out << pose.Eye[0] << " " << pose.Eye[1] << " " << pose.Eye[2];
+    out << " " << pose.Dir[0] << " " << pose.Dir[1] << " " << pose.Dir[2];
+    out << " " << pose.Up[0] << " " << pose.Up[1] << " " << pose.Up[2];
+}
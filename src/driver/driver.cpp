@@ -6,6 +6,7 @@
 #include <chrono>
 #include <cmath>
 #include <array>
+#include <fstream>
 
 #ifndef DISABLE_GUI
 #include "ui.h"
@@ -31,14 +32,69 @@ void setup_interface(size_t, size_t);
 float* get_pixels();
 void clear_pixels();
 void cleanup_interface();
+void set_profiling_mode(int32_t);
+void get_profile(ProfileCounters&);
+void set_adaptive_threshold(float);
+void enable_aovs();
+const float* get_aov_pixels();
+const float* get_denoised_pixels(uint32_t);
+float refit_scene(const std::string&);
+void set_thread_affinity(const std::vector<int>&);
+void save_checkpoint(const std::string&, const Settings&, uint32_t);
+uint32_t load_checkpoint(const std::string&, const Settings&);
 
-static void save_image(const std::string& out_file, size_t width, size_t height, uint32_t iter) {
+struct FrameProfile {
+    ProfileCounters counters;
+    int64_t elapsed_us;
+    uint32_t samples;
+};
+
+static void save_profile(const std::string& file_name, const std::vector<FrameProfile>& frames) {
+    std::ofstream of(file_name);
+    if (!of)
+        error("Cannot open profile file '", file_name, "'");
+
+    // Stage timings are in microseconds, summed over all threads
+    of << "[\n";
+    for (size_t i = 0; i < frames.size(); ++i) {
+        auto& frame = frames[i];
+        auto& c = frame.counters;
+        of << "    { \"frame\": " << i
+           << ", \"samples\": " << frame.samples
+           << ", \"elapsed\": " << frame.elapsed_us
+           << ", \"rays\": " << c.rays
+           << ", \"generation\": " << c.generation
+           << ", \"primary\": " << c.primary
+           << ", \"bounces\": " << c.bounces
+           << ", \"sort\": " << c.sort
+           << ", \"shade\": " << c.shade
+           << ", \"compaction\": " << c.compaction
+           << ", \"shadow\": " << c.shadow
+           << ", \"accumulation\": " << c.accumulation
+           << ", \"total\": " << c.total
+           << " }" << (i + 1 < frames.size() ? ",\n" : "\n");
+    }
+    of << "]" << std::endl;
+}
+
+static void save_image(const std::string& out_file, size_t width, size_t height, uint32_t iter, bool denoise) {
     ImageRgba32 img;
     img.width = width;
     img.height = height;
     img.pixels.reset(new float[width * height * 4]);
 
-    auto film = get_pixels();
+    auto film = (const float*)get_pixels();
+    if (denoise) {
+        auto start = std::chrono::steady_clock::now();
+        // Without AOVs or samples there is nothing to denoise, and the image is saved as is
+        if (auto denoised = get_denoised_pixels(iter)) {
+            film = denoised;
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            info("Denoised '", out_file, "' in ", elapsed, "ms");
+        } else {
+            warn("Cannot denoise '", out_file, "', the image is saved without denoising");
+        }
+    }
     auto inv_iter = 1.0f / iter;
     for (size_t y = 0; y < height; ++y) {
         for (size_t x = 0; x < width; ++x) {
@@ -53,10 +109,131 @@ static void save_image(const std::string& out_file, size_t width, size_t height,
         }
     }
 
-    if (!save_exr(out_file, img))
+    std::vector<ExrChannel> channels = {
+        ExrChannel { "R", img.pixels.get() + 0, 4 },
+        ExrChannel { "G", img.pixels.get() + 1, 4 },
+        ExrChannel { "B", img.pixels.get() + 2, 4 },
+        ExrChannel { "A", img.pixels.get() + 3, 4 }
+    };
+
+    // Auxiliary outputs are stored as additional layers
+    std::vector<float> aovs;
+    if (auto aov_pixels = get_aov_pixels()) {
+        aovs.resize(width * height * 8);
+        for (size_t i = 0; i < width * height; ++i) {
+            auto albedo = xyz_to_srgb(float3(aov_pixels[i * 8 + 0], aov_pixels[i * 8 + 1], aov_pixels[i * 8 + 2]));
+            aovs[i * 8 + 0] = albedo.x * inv_iter;
+            aovs[i * 8 + 1] = albedo.y * inv_iter;
+            aovs[i * 8 + 2] = albedo.z * inv_iter;
+            for (size_t c = 3; c < 7; ++c)
+                aovs[i * 8 + c] = aov_pixels[i * 8 + c] * inv_iter;
+            aovs[i * 8 + 7] = aov_pixels[i * 8 + 7];
+        }
+        channels.insert(channels.end(), {
+            ExrChannel { "albedo.R",  aovs.data() + 0, 8 },
+            ExrChannel { "albedo.G",  aovs.data() + 1, 8 },
+            ExrChannel { "albedo.B",  aovs.data() + 2, 8 },
+            ExrChannel { "normal.X",  aovs.data() + 3, 8 },
+            ExrChannel { "normal.Y",  aovs.data() + 4, 8 },
+            ExrChannel { "normal.Z",  aovs.data() + 5, 8 },
+            ExrChannel { "depth.Z",   aovs.data() + 6, 8 },
+            ExrChannel { "geom_id.R", aovs.data() + 7, 8 }
+        });
+    }
+
+    if (!save_exr(out_file, width, height, channels))
         error("Failed to save EXR file '", out_file, "'");
 }
 
+static inline Settings make_settings(const Camera& cam, int32_t num_threads, int32_t tile_size) {
+    return Settings {
+        Vec3 { cam.eye.x, cam.eye.y, cam.eye.z },
+        Vec3 { cam.dir.x, cam.dir.y, cam.dir.z },
+        Vec3 { cam.up.x, cam.up.y, cam.up.z },
+        Vec3 { cam.right.x, cam.right.y, cam.right.z },
+        cam.w,
+        cam.h,
+        num_threads,
+        tile_size
+    };
+}
+
+static std::vector<CameraPose> read_pose_list(const std::string& file_name) {
+    std::ifstream is(file_name);
+    if (!is)
+        error("Cannot open pose file '", file_name, "'");
+
+    // Files saved from the viewer always have 10 lines, and the unused slots hold the default pose
+    std::vector<CameraPose> poses;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::istringstream line_stream(line);
+        auto pose = read_pose(line_stream);
+        if (!line_stream) {
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                error("Invalid pose '", line, "' in '", file_name, "'");
+            continue;
+        }
+        CameraPose def;
+        auto same = [] (const float3& a, const float3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+        if (same(pose.Eye, def.Eye) && same(pose.Dir, def.Dir) && same(pose.Up, def.Up))
+            continue;
+        poses.push_back(pose);
+    }
+    if (poses.empty())
+        error("No pose in '", file_name, "'");
+    return poses;
+}
+
+// Renders every pose for the given number of iterations, and writes one image per pose.
+// The scene is loaded on the first frame, and its buffers stay loaded for the next poses.
+static void render_poses(const std::vector<CameraPose>& poses, Camera cam, size_t width, size_t height, uint32_t iters,
+                         int32_t num_threads, int32_t tile_size, const std::string& file_prefix, bool denoise) {
+    auto spp = get_spp();
+    for (size_t i = 0; i < poses.size(); ++i) {
+        poses[i].apply(cam);
+        clear_pixels();
+
+        auto ticks = std::chrono::high_resolution_clock::now();
+        for (uint32_t iter = 0; iter < iters; ++iter) {
+            auto settings = make_settings(cam, num_threads, tile_size);
+            render(&settings, iter);
+        }
+        auto elapsed = std::chrono::high_resolution_clock::now() - ticks;
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+
+        std::ostringstream file_name;
+        file_name << file_prefix << i << ".exr";
+        save_image(file_name.str(), width, height, iters, denoise);
+        info("Pose ", i + 1, "/", poses.size(), " rendered with ", iters * spp, " samples in ", elapsed_ms,
+             " ms, saved to '", file_name.str(), "'");
+    }
+}
+
+// Parses a list of cores such as "0-3,8,10-11"
+static std::vector<int> parse_core_list(const char* str) {
+    std::vector<int> cores;
+    const char* p = str;
+    while (true) {
+        char* end;
+        auto first = strtol(p, &end, 10);
+        auto last = first;
+        if (end == p) break;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) break;
+        }
+        for (auto core = first; core <= last; ++core)
+            cores.push_back(core);
+        if (*end == 0)
+            return cores;
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    error("Invalid list of cores '", str, "'");
+}
+
 static inline void check_arg(int argc, char** argv, int arg, int n) {
     if (arg + n >= argc)
         error("Option '", argv[arg], "' expects ", n, " arguments, got ", argc - arg);
@@ -75,11 +252,37 @@ static inline void usage() {
               << "   --spp    spp        Enables benchmarking mode and sets the number of iterations based on the given spp\n"
               << "   --bench  iterations Enables benchmarking mode and sets the number of iterations\n"
               << "   --nimg   iterations Enables output extraction every n iterations\n"
+              << "   --profile file.json Records the time spent in every rendering stage, per frame\n"
+              << "   --profile-serial    Renders on one thread while profiling, to avoid contention\n"
+              << "   --denoise           Denoises the output image, guided by the AOVs (enables --aov)\n"
+              << "   --aov               Adds the albedo, normal, depth and geometry id of the first hit as layers of the output image (CPU only)\n"
+              << "   --adaptive error    Stops sampling the pixels whose relative error falls below the given threshold (CPU only)\n"
+              << "   --threads n         Sets the number of rendering threads (CPU only, defaults to the number of available cores)\n"
+              << "   --tile-size pixels  Sets the size of the tiles rendered by each thread (CPU only, chosen from the image size by default)\n"
+              << "   --affinity cores    Restricts the renderer to the given cores, e.g. 0-3,8 (CPU only, Linux only)\n"
+              << "   --poses  file.lst   Renders every pose of the file (same format as data/poses.lst) without opening a window,\n"
+              << "                       with the number of iterations given by --spp or --bench, and writes one image per pose\n"
+              << "   --checkpoint file   Saves the accumulated samples to the file periodically and at exit, and resumes from it if it exists\n"
+              << "   --checkpoint-interval seconds\n"
+              << "                       Sets the time between two checkpoints (600 seconds by default)\n"
+              << "   --vertices file.bin Replaces the vertex positions of the scene and refits the BVH (same layout as data/vertices.bin)\n"
               << "   -o       image.exr  Writes the output image to a file" << std::endl;
 }
 
 int main(int argc, char** argv) {
     std::string out_file;
+    std::string profile_file;
+    std::string vertices_file;
+    std::string poses_file;
+    std::string checkpoint_file;
+    double checkpoint_interval = 600.0;
+    std::vector<int> affinity;
+    int32_t num_threads = 0;
+    int32_t tile_size = 0;
+    bool profile_serial = false;
+    float adaptive_threshold = 0.0f;
+    bool aovs = false;
+    bool denoise = false;
     size_t bench_iter = 0;
     size_t nimg_iter = 0;
     size_t width  = 1080;
@@ -122,6 +325,43 @@ int main(int argc, char** argv) {
             } else if (!strcmp(argv[i], "--bench")) {
                 check_arg(argc, argv, i, 1);
                 bench_iter = strtoul(argv[++i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--profile")) {
+                check_arg(argc, argv, i, 1);
+                profile_file = argv[++i];
+            } else if (!strcmp(argv[i], "--profile-serial")) {
+                profile_serial = true;
+            } else if (!strcmp(argv[i], "--aov")) {
+                aovs = true;
+            } else if (!strcmp(argv[i], "--denoise")) {
+                aovs = denoise = true;
+            } else if (!strcmp(argv[i], "--adaptive")) {
+                check_arg(argc, argv, i, 1);
+                adaptive_threshold = strtof(argv[++i], nullptr);
+            } else if (!strcmp(argv[i], "--threads")) {
+                check_arg(argc, argv, i, 1);
+                num_threads = strtol(argv[++i], nullptr, 10);
+                if (num_threads <= 0)
+                    error("The number of threads must be positive");
+            } else if (!strcmp(argv[i], "--tile-size")) {
+                check_arg(argc, argv, i, 1);
+                tile_size = strtol(argv[++i], nullptr, 10);
+                if (tile_size <= 0)
+                    error("The tile size must be positive");
+            } else if (!strcmp(argv[i], "--affinity")) {
+                check_arg(argc, argv, i, 1);
+                affinity = parse_core_list(argv[++i]);
+            } else if (!strcmp(argv[i], "--poses")) {
+                check_arg(argc, argv, i, 1);
+                poses_file = argv[++i];
+            } else if (!strcmp(argv[i], "--checkpoint")) {
+                check_arg(argc, argv, i, 1);
+                checkpoint_file = argv[++i];
+            } else if (!strcmp(argv[i], "--checkpoint-interval")) {
+                check_arg(argc, argv, i, 1);
+                checkpoint_interval = strtod(argv[++i], nullptr);
+            } else if (!strcmp(argv[i], "--vertices")) {
+                check_arg(argc, argv, i, 1);
+                vertices_file = argv[++i];
             } else if (!strcmp(argv[i], "-o")) {
                 check_arg(argc, argv, i, 1);
                 out_file = argv[++i];
@@ -136,23 +376,47 @@ int main(int argc, char** argv) {
         error("Unexpected argument '", argv[i], "'");
     }
 
+    // Done before anything else, so that every thread started by the renderer inherits it
+    if (!affinity.empty())
+        set_thread_affinity(affinity);
+
     std::string iter_file_prefix = "iteration_";
     if(out_file != "")
         iter_file_prefix = FilePath(out_file).remove_extension() + "_";
 
     Camera cam(eye, dir, up, fov, (float)width / (float)height);
 
+    std::vector<CameraPose> poses;
+    if (poses_file != "") {
+        poses = read_pose_list(poses_file);
+        if (nimg_iter != 0 || profile_file != "" || checkpoint_file != "")
+            warn("Options '--nimg', '--profile' and '--checkpoint' have no effect with '--poses'.");
+    }
+
 #ifdef DISABLE_GUI
     info("Running in console-only mode (compiled with -DDISABLE_GUI).");
-    if (bench_iter == 0) {
+    bool headless = true;
+#else
+    bool headless = !poses.empty();
+    if (!headless)
+        rodent_ui_init(width, height);
+#endif
+    if (headless && bench_iter == 0) {
         warn("Benchmark iterations not set. Defaulting to 1.");
         bench_iter = 1;
     }
-#else
-    rodent_ui_init(width, height);
-#endif
+
+    if (profile_serial && profile_file == "")
+        warn("Option '--profile-serial' has no effect without '--profile'.");
 
     setup_interface(width, height);
+    if (profile_file != "")
+        set_profiling_mode(profile_serial ? 2 : 1);
+    set_adaptive_threshold(adaptive_threshold);
+    if (aovs)
+        enable_aovs();
+    if (vertices_file != "")
+        refit_scene(vertices_file);
 
     // Force flush to zero mode for denormals
 #if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
@@ -163,6 +427,13 @@ int main(int argc, char** argv) {
     feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);
 #endif
 
+    if (!poses.empty()) {
+        auto pose_file_prefix = out_file != "" ? FilePath(out_file).remove_extension() + "_" : std::string("pose_");
+        render_poses(poses, cam, width, height, bench_iter, num_threads, tile_size, pose_file_prefix, denoise);
+        cleanup_interface();
+        return 0;
+    }
+
     auto spp = get_spp();
     bool done = false;
     uint64_t timing = 0;
@@ -170,6 +441,17 @@ int main(int argc, char** argv) {
     uint32_t iter = 0;
     uint32_t niter = 0;
     std::vector<double> samples_sec;
+    std::vector<FrameProfile> profile;
+
+    // The iteration counter is also the frame index of the samplers, so restoring it continues the same sequence
+    uint32_t first_iter = 0;
+    if (checkpoint_file != "" && std::ifstream(checkpoint_file).good()) {
+        first_iter = iter = load_checkpoint(checkpoint_file, make_settings(cam, num_threads, tile_size));
+        info("Resuming from checkpoint '", checkpoint_file, "' at ", iter * spp, " samples");
+        done = bench_iter != 0 && iter >= bench_iter;
+    }
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
     while (!done) {
 #ifndef DISABLE_GUI
         done = rodent_ui_handleinput(iter, cam);
@@ -177,22 +459,24 @@ int main(int argc, char** argv) {
         if (iter == 0)
             clear_pixels();
 
-        Settings settings {
-            Vec3 { cam.eye.x, cam.eye.y, cam.eye.z },
-            Vec3 { cam.dir.x, cam.dir.y, cam.dir.z },
-            Vec3 { cam.up.x, cam.up.y, cam.up.z },
-            Vec3 { cam.right.x, cam.right.y, cam.right.z },
-            cam.w,
-            cam.h
-        };
+        auto settings = make_settings(cam, num_threads, tile_size);
 
         auto ticks = std::chrono::high_resolution_clock::now();
         render(&settings, iter++);
-        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - ticks).count();
+        auto elapsed = std::chrono::high_resolution_clock::now() - ticks;
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+
+        if (profile_file != "") {
+            FrameProfile frame;
+            get_profile(frame.counters);
+            frame.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            frame.samples = spp;
+            profile.push_back(frame);
+        }
 
         if (bench_iter != 0) {
             samples_sec.emplace_back(1000.0 * double(spp * width * height) / double(elapsed_ms));
-            if (samples_sec.size() == bench_iter)
+            if (first_iter + samples_sec.size() >= bench_iter)
                 break;
         }
 
@@ -202,11 +486,18 @@ int main(int argc, char** argv) {
                 niter = 0;
                 std::stringstream sstream;
                 sstream << iter_file_prefix << iter * spp << ".exr";
-                save_image(sstream.str(), width, height, iter);
+                save_image(sstream.str(), width, height, iter, denoise);
                 info("Iteration image saved to '", sstream.str(), "'");
             }
         }
 
+        if (checkpoint_file != "" &&
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() >= checkpoint_interval) {
+            save_checkpoint(checkpoint_file, settings, iter);
+            last_checkpoint = std::chrono::steady_clock::now();
+            info("Checkpoint saved to '", checkpoint_file, "' at ", iter * spp, " samples");
+        }
+
         frames++;
         timing += elapsed_ms;
         if (frames > 10 || timing >= 2500) {
@@ -230,14 +521,24 @@ int main(int argc, char** argv) {
     rodent_ui_close();
 #endif
 
+    if (checkpoint_file != "") {
+        save_checkpoint(checkpoint_file, make_settings(cam, num_threads, tile_size), iter);
+        info("Checkpoint saved to '", checkpoint_file, "' at ", iter * spp, " samples");
+    }
+
     if (out_file != "") {
-        save_image(out_file, width, height, iter);
+        save_image(out_file, width, height, iter, denoise);
         info("Image saved to '", out_file, "'");
     }
 
     cleanup_interface();
 
-    if (bench_iter != 0) {
+    if (profile_file != "") {
+        save_profile(profile_file, profile);
+        info("Profile saved to '", profile_file, "'");
+    }
+
+    if (bench_iter != 0 && !samples_sec.empty()) {
         auto inv = 1.0e-6;
         std::sort(samples_sec.begin(), samples_sec.end());
         info("# ", samples_sec.front() * inv,
@@ -2,29 +2,74 @@
 #include <memory>
 #include <chrono>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include <fstream>
+#include <thread>
 
-#include <anydsl_runtime.hpp>
-
-#if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
-#include <x86intrin.h>
+#ifdef __linux__
+#include <sched.h>
 #endif
 
+#include <anydsl_runtime.hpp>
+
 #include "interface.h"
 #include "runtime/bvh.h"
+#include "runtime/bvh_refit.h"
+#include "runtime/mesh.h"
 #include "runtime/obj.h"
+#include "runtime/denoiser.h"
 #include "runtime/image.h"
 #include "runtime/buffer.h"
+#include "runtime/mapped_file.h"
+#include "runtime/distribution.h"
+
+/// Buffer loaded on a device. On the host, uncompressed buffers are used
+/// in place from the memory-mapped file, and do not own their memory.
+template <typename T>
+struct DeviceBuffer {
+    anydsl::Array<T> array;
+    const T* ptr = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+
+    const T* data() const { return ptr; }
+};
 
 template <typename Node, typename Tri>
 struct Bvh {
-    anydsl::Array<Node> nodes;
-    anydsl::Array<Tri>  tris;
+    DeviceBuffer<Node> nodes;
+    DeviceBuffer<Tri>  tris;
+    float built_cost = 0.0f;    // SAH cost of the BVH as it was built, computed before the first refit
+};
+
+// Increase of the SAH cost of a refitted BVH above which a full rebuild is recommended
+static constexpr float refit_rebuild_threshold = 1.5f;
+
+// Checkpoints hold the raw accumulation state of the film, so that rendering can resume exactly where it stopped.
+// The header is followed by the film (3 floats per pixel), then the AOVs and the adaptive sampling statistics, if present.
+static constexpr uint32_t checkpoint_magic = 0x4B434452; // "RDCK"
+static constexpr uint32_t checkpoint_version = 1;
+
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t iter;              // Number of frames in the film, which is also the index of the next frame
+    int32_t spp;
+    int32_t adaptive_frames;
+    float adaptive_threshold;
+    uint32_t aov_size;          // Number of floats in each of the following buffers (0 if absent)
+    uint32_t adaptive_size;
+    float camera[14];           // Camera of the frames: eye, dir, up, right, width and height of the settings
 };
 
 using Bvh2Tri1 = Bvh<Node2, Tri1>;
 using Bvh4Tri4 = Bvh<Node4, Tri4>;
 using Bvh8Tri4 = Bvh<Node8, Tri4>;
+using Bvh4Instance = Bvh<Node4, Instance>;
+using Bvh8Instance = Bvh<Node8, Instance>;
 
 #ifdef ENABLE_EMBREE_DEVICE
 #error Embree integration is broken due to spectral tracing!
@@ -263,6 +308,7 @@ struct EmbreeDevice {
             auto prim_id = ray_hit.hit.primID[k];
             primary.geom_id[j] = prim_id == RTC_INVALID_GEOMETRY_ID ? invalid_id : indices[prim_id * 4 + 3];
             primary.prim_id[j] = prim_id;
+            primary.inst_id[j] = -1;
             primary.t[j]       = ray_hit.ray.tfar[k];
             primary.u[j]       = ray_hit.hit.u[k];
             primary.v[j]       = ray_hit.hit.v[k];
@@ -286,6 +332,7 @@ struct EmbreeDevice {
             auto prim_id = ray.primID[k];
             primary.geom_id[j] = prim_id == RTC_INVALID_GEOMETRY_ID ? invalid_id : indices[prim_id * 4 + 3];
             primary.prim_id[j] = prim_id;
+            primary.inst_id[j] = -1;
             primary.t[j]       = ray.tfar[k];
             primary.u[j]       = ray.u[k];
             primary.v[j]       = ray.v[k];
@@ -330,7 +377,9 @@ struct Interface {
         std::unordered_map<std::string, Bvh2Tri1> bvh2_tri1;
         std::unordered_map<std::string, Bvh4Tri4> bvh4_tri4;
         std::unordered_map<std::string, Bvh8Tri4> bvh8_tri4;
-        std::unordered_map<std::string, anydsl::Array<uint8_t>> buffers;
+        std::unordered_map<std::string, Bvh4Instance> bvh4_instances;
+        std::unordered_map<std::string, Bvh8Instance> bvh8_instances;
+        std::unordered_map<std::string, DeviceBuffer<uint8_t>> buffers;
         std::unordered_map<std::string, DeviceImage> images;
         anydsl::Array<int32_t> tmp_buffer;
         anydsl::Array<float> first_primary;
@@ -339,22 +388,41 @@ struct Interface {
         anydsl::Array<float> film_pixels;
     };
     std::unordered_map<int32_t, DeviceData> devices;
+    std::vector<MappedFile> mapped_files;
 
     static thread_local anydsl::Array<float> cpu_primary;
     static thread_local anydsl::Array<float> cpu_secondary;
+    static thread_local anydsl::Array<float> cpu_spare_primary;
+    static thread_local anydsl::Array<int32_t> cpu_tmp;
 
 #ifdef ENABLE_EMBREE_DEVICE
     EmbreeDevice embree_device;
 #endif
 
-    anydsl::Array<float> host_pixels;
+    anydsl::Array<float> host_pixels;       // Accumulated CIE XYZ values
+    std::vector<float> display_pixels;      // Linear sRGB values, updated when a frame is presented
     size_t film_width;
     size_t film_height;
 
+    int32_t profiling_mode = 0;             // 0: disabled, 1: parallel, 2: serial
+    ProfileCounters profile = {};           // Counters accumulated since the last call to get_profile()
+
+    float adaptive_threshold = 0.0f;        // Relative error under which pixels stop being sampled (0: disabled)
+    int32_t adaptive_frames = 0;            // Number of frames accumulated in the film since the last clear
+    std::vector<float> adaptive_stats;      // Per-pixel luminance statistics (see rodent_begin_adaptive_frame)
+    std::vector<float> aov_pixels;          // Accumulated albedo (CIE XYZ), normal, depth, and geometry id, if enabled
+    std::vector<float> denoised_pixels;     // Denoised linear sRGB values, updated by denoise()
+    Denoiser denoiser;
+
+    std::vector<float3> refit_vertices;     // Vertices given to refit(), empty if the scene has not been refitted
+    std::vector<uint32_t> refit_indices;
+    std::unordered_map<std::string, std::vector<uint8_t>> refit_buffers; // Scene buffers that replace the files after a refit
+
     Interface(size_t width, size_t height)
         : film_width(width)
         , film_height(height)
         , host_pixels(width * height * 3)
+        , display_pixels(width * height * 3)
     {}
 
     template <typename T>
@@ -368,7 +436,7 @@ struct Interface {
     }
 
 #define RAY_STREAM_SIZE (13)
-#define PRIMARY_SIZE (RAY_STREAM_SIZE + 12)
+#define PRIMARY_SIZE (RAY_STREAM_SIZE + 14)
 #define SECONDARY_SIZE (RAY_STREAM_SIZE + 5)
     anydsl::Array<float>& cpu_primary_stream(size_t size) {
         return resize_array(0, cpu_primary, size, PRIMARY_SIZE);
@@ -378,6 +446,14 @@ struct Interface {
         return resize_array(0, cpu_secondary, size, SECONDARY_SIZE);
     }
 
+    anydsl::Array<float>& cpu_spare_primary_stream(size_t size) {
+        return resize_array(0, cpu_spare_primary, size, PRIMARY_SIZE);
+    }
+
+    anydsl::Array<int32_t>& cpu_tmp_buffer(size_t size) {
+        return resize_array(0, cpu_tmp, size, 1);
+    }
+
     anydsl::Array<float>& gpu_first_primary_stream(int32_t dev, size_t size) {
         return resize_array(dev, devices[dev].first_primary, size, PRIMARY_SIZE);
     }
@@ -399,7 +475,10 @@ struct Interface {
         auto it = bvh2_tri1.find(filename);
         if (it != bvh2_tri1.end())
             return it->second;
-        return bvh2_tri1[filename] = std::move(load_bvh<Node2, Tri1>(dev, filename));
+        auto& bvh = bvh2_tri1[filename] = std::move(load_bvh<Node2, Tri1>(dev, filename));
+        if (!refit_vertices.empty())
+            refit_bvh(dev, bvh);
+        return bvh;
     }
 
     const Bvh4Tri4& load_bvh4_tri4(int32_t dev, const std::string& filename) {
@@ -407,7 +486,10 @@ struct Interface {
         auto it = bvh4_tri4.find(filename);
         if (it != bvh4_tri4.end())
             return it->second;
-        return bvh4_tri4[filename] = std::move(load_bvh<Node4, Tri4>(dev, filename));
+        auto& bvh = bvh4_tri4[filename] = std::move(load_bvh<Node4, Tri4>(dev, filename));
+        if (!refit_vertices.empty())
+            refit_bvh(dev, bvh);
+        return bvh;
     }
 
     const Bvh8Tri4& load_bvh8_tri4(int32_t dev, const std::string& filename) {
@@ -415,7 +497,30 @@ struct Interface {
         auto it = bvh8_tri4.find(filename);
         if (it != bvh8_tri4.end())
             return it->second;
-        return bvh8_tri4[filename] = std::move(load_bvh<Node8, Tri4>(dev, filename));
+        auto& bvh = bvh8_tri4[filename] = std::move(load_bvh<Node8, Tri4>(dev, filename));
+        if (!refit_vertices.empty())
+            refit_bvh(dev, bvh);
+        return bvh;
+    }
+
+    const Bvh4Instance& load_bvh4_instances(int32_t dev, const std::string& filename) {
+        auto& bvh4_instances = devices[dev].bvh4_instances;
+        auto it = bvh4_instances.find(filename);
+        if (it != bvh4_instances.end())
+            return it->second;
+        if (!refit_vertices.empty())
+            error("Scenes with instances cannot be refitted");
+        return bvh4_instances[filename] = std::move(load_bvh<Node4, Instance>(dev, filename));
+    }
+
+    const Bvh8Instance& load_bvh8_instances(int32_t dev, const std::string& filename) {
+        auto& bvh8_instances = devices[dev].bvh8_instances;
+        auto it = bvh8_instances.find(filename);
+        if (it != bvh8_instances.end())
+            return it->second;
+        if (!refit_vertices.empty())
+            error("Scenes with instances cannot be refitted");
+        return bvh8_instances[filename] = std::move(load_bvh<Node8, Instance>(dev, filename));
     }
 
     template <typename T>
@@ -434,42 +539,293 @@ struct Interface {
         return DeviceImage(copy_to_device(dev, img.pixels.get(), img.width * img.height * 4), img.width, img.height);
     }
 
+    template <typename T>
+    DeviceBuffer<T> load_device_buffer(int32_t dev, const BufferView& view, const std::string& filename) {
+        DeviceBuffer<T> buffer;
+        auto n = view.out_size / sizeof(T);
+        buffer.size = n;
+        if (!view.compressed) {
+            if (dev == 0 && reinterpret_cast<uintptr_t>(view.data) % alignof(T) == 0) {
+                buffer.ptr = reinterpret_cast<const T*>(view.data);
+                buffer.mapped = true;
+                return buffer;
+            }
+            buffer.array = std::move(copy_to_device(dev, reinterpret_cast<const T*>(view.data), n));
+        } else if (dev == 0) {
+            // Decompress directly into the final allocation
+            buffer.array = std::move(anydsl::Array<T>(dev, reinterpret_cast<T*>(anydsl_alloc(dev, n * sizeof(T))), n));
+            if (!unpack_buffer(view, buffer.array.data()))
+                error("Corrupted buffer in '", filename, "'");
+        } else {
+            std::vector<T> host(n);
+            if (!unpack_buffer(view, host.data()))
+                error("Corrupted buffer in '", filename, "'");
+            buffer.array = std::move(copy_to_device(dev, host));
+        }
+        buffer.ptr = buffer.array.data();
+        return buffer;
+    }
+
     template <typename Node, typename Tri>
     Bvh<Node, Tri> load_bvh(int32_t dev, const std::string& filename) {
-        std::ifstream is(filename, std::ios::binary);
-        if (!is)
+        MappedFile file(filename);
+        if (!file.is_open())
             error("Cannot open BVH '", filename, "'");
-        do {
-            size_t node_size = 0, tri_size = 0;
-            is.read((char*)&node_size, sizeof(uint32_t));
-            is.read((char*)&tri_size,  sizeof(uint32_t));
+        size_t offset = 0;
+        while (offset + 2 * sizeof(uint32_t) <= file.size()) {
+            uint32_t node_size = 0, tri_size = 0;
+            std::memcpy(&node_size, file.data() + offset, sizeof(uint32_t));
+            std::memcpy(&tri_size,  file.data() + offset + sizeof(uint32_t), sizeof(uint32_t));
+            BufferView nodes, tris;
+            offset = parse_buffer(file.data(), offset + 2 * sizeof(uint32_t), file.size(), nodes);
+            if (offset)
+                offset = parse_buffer(file.data(), offset, file.size(), tris);
+            if (!offset)
+                break;
             if (node_size == sizeof(Node) &&
                 tri_size  == sizeof(Tri)) {
                 info("Loaded BVH file '", filename, "'");
-                std::vector<Node> nodes;
-                std::vector<Tri>  tris;
-                read_buffer(is, nodes);
-                read_buffer(is, tris);
-                return Bvh<Node, Tri> { std::move(copy_to_device(dev, nodes)), std::move(copy_to_device(dev, tris)) };
+                Bvh<Node, Tri> bvh { load_device_buffer<Node>(dev, nodes, filename), load_device_buffer<Tri>(dev, tris, filename) };
+                if (bvh.nodes.mapped || bvh.tris.mapped)
+                    mapped_files.emplace_back(std::move(file));
+                return bvh;
             }
-            skip_buffer(is);
-            skip_buffer(is);
-        } while (!is.eof() && is);
+        }
         error("Invalid BVH file");
     }
 
-    const anydsl::Array<uint8_t>& load_buffer(int32_t dev, const std::string& filename) {
+    // Reads and unpacks a buffer file on the host
+    std::vector<uint8_t> read_host_buffer(const std::string& filename) {
+        MappedFile file(filename);
+        if (!file.is_open())
+            error("Cannot open buffer '", filename, "'");
+        BufferView view;
+        if (!parse_buffer(file.data(), 0, file.size(), view))
+            error("Invalid buffer '", filename, "'");
+        std::vector<uint8_t> data(view.out_size);
+        if (!unpack_buffer(view, data.data()))
+            error("Corrupted buffer in '", filename, "'");
+        return data;
+    }
+
+    // Refits a BVH to the vertices given to refit(), and returns its SAH cost relative to the BVH as it was built.
+    // On the host, the BVH is updated in place (after copying it, if it is used directly from the file).
+    template <typename Node, typename Tri>
+    float refit_bvh(int32_t dev, Bvh<Node, Tri>& bvh) {
+        std::vector<Node> host_nodes;
+        std::vector<Tri>  host_tris;
+        Node* nodes = nullptr;
+        Tri*  tris  = nullptr;
+        if (dev == 0) {
+            if (bvh.nodes.mapped) bvh.nodes.array = std::move(copy_to_device(dev, bvh.nodes.data(), bvh.nodes.size));
+            if (bvh.tris.mapped)  bvh.tris.array  = std::move(copy_to_device(dev, bvh.tris.data(),  bvh.tris.size));
+            bvh.nodes.ptr = nodes = bvh.nodes.array.data();
+            bvh.tris.ptr  = tris  = bvh.tris.array.data();
+            bvh.nodes.mapped = bvh.tris.mapped = false;
+        } else {
+            host_nodes.resize(bvh.nodes.size);
+            host_tris.resize(bvh.tris.size);
+            anydsl_copy(dev, bvh.nodes.data(), 0, 0, host_nodes.data(), 0, sizeof(Node) * host_nodes.size());
+            anydsl_copy(dev, bvh.tris.data(),  0, 0, host_tris.data(),  0, sizeof(Tri)  * host_tris.size());
+            nodes = host_nodes.data();
+            tris  = host_tris.data();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (bvh.built_cost == 0.0f)
+            bvh.built_cost = bvh_sah_cost(nodes, bvh.nodes.size, tris);
+        ::refit_bvh(nodes, bvh.nodes.size, tris, bvh.tris.size, refit_vertices.data(), refit_indices.data());
+        auto cost = bvh_sah_cost(nodes, bvh.nodes.size, tris) / bvh.built_cost;
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        info("Refitted BVH in ", elapsed, "ms (SAH cost: ", cost, " times the initial cost)");
+        if (cost > refit_rebuild_threshold)
+            warn("The quality of the refitted BVH is low, consider running the generator again");
+
+        if (dev != 0) {
+            anydsl_copy(0, host_nodes.data(), 0, dev, bvh.nodes.array.data(), 0, sizeof(Node) * host_nodes.size());
+            anydsl_copy(0, host_tris.data(),  0, dev, bvh.tris.array.data(),  0, sizeof(Tri)  * host_tris.size());
+        }
+        return cost;
+    }
+
+    // Updates the lights after the vertices have moved. The triangle lights that the generator stores in buffers
+    // are recomputed, along with the probabilities to pick them. Triangle lights that are part of the generated code
+    // cannot be updated, so their triangles must not move. Lights that sample the mesh itself need no update.
+    void refit_lights(const std::vector<float3>& old_positions) {
+        MappedFile light_tris_file("data/light_tris.bin");
+        MappedFile light_verts_file("data/light_verts.bin");
+        if (!light_tris_file.is_open()) {
+            if (light_verts_file.is_open())
+                error("The lights of the scene cannot be refitted, run the generator again");
+            return;
+        }
+
+        auto light_tris = read_host_buffer("data/light_tris.bin");
+        auto num_lights = light_tris.size() / sizeof(uint32_t);
+        auto light_tri = [&] (size_t i) {
+            uint32_t tri = 0;
+            std::memcpy(&tri, light_tris.data() + i * sizeof(uint32_t), sizeof(uint32_t));
+            if (tri * 4 + 3 >= refit_indices.size())
+                error("Invalid light in 'data/light_tris.bin'");
+            return tri;
+        };
+
+        if (!light_verts_file.is_open()) {
+            for (size_t i = 0; i < num_lights; ++i) {
+                auto tri = light_tri(i);
+                for (size_t k = 0; k < 3; ++k) {
+                    auto& v = refit_vertices[refit_indices[tri * 4 + k]];
+                    auto& w = old_positions[refit_indices[tri * 4 + k]];
+                    if (v.x != w.x || v.y != w.y || v.z != w.z)
+                        error("Emissive triangles cannot be moved in this scene, as they are part of the generated code");
+                }
+            }
+            return;
+        }
+
+        auto light_verts  = read_host_buffer("data/light_verts.bin");
+        auto light_norms  = read_host_buffer("data/light_norms.bin");
+        auto light_areas  = read_host_buffer("data/light_areas.bin");
+        auto light_select = read_host_buffer("data/light_select.bin");
+        if (num_lights == 0 ||
+            light_verts.size()  % (3 * num_lights) != 0 ||
+            light_norms.size()  % num_lights != 0 ||
+            light_areas.size()  != num_lights * sizeof(float) ||
+            light_select.size() != num_lights * sizeof(AliasEntry))
+            error("The light buffers have inconsistent sizes");
+
+        // Elements are padded to 16 bytes for GPU targets
+        auto vert_stride = light_verts.size() / (3 * num_lights);
+        auto norm_stride = light_norms.size() / num_lights;
+        std::vector<float> weights(num_lights);
+        for (size_t i = 0; i < num_lights; ++i) {
+            auto tri = light_tri(i);
+            auto& v0 = refit_vertices[refit_indices[tri * 4 + 0]];
+            auto& v1 = refit_vertices[refit_indices[tri * 4 + 1]];
+            auto& v2 = refit_vertices[refit_indices[tri * 4 + 2]];
+            auto n = cross(v1 - v0, v2 - v0);
+            auto area = 0.5f * length(n);
+            auto inv_area = 1.0f / area;
+            n = normalize(n);
+
+            // Lights are picked proportionally to their power, which scales with their area
+            float old_inv_area;
+            AliasEntry entry;
+            std::memcpy(&old_inv_area, light_areas.data() + i * sizeof(float), sizeof(float));
+            std::memcpy(&entry, light_select.data() + i * sizeof(AliasEntry), sizeof(AliasEntry));
+            auto old_area = 1.0f / old_inv_area;
+            weights[i] = old_area > 0.0f ? entry.pdf * area / old_area : 0.0f;
+
+            std::memcpy(light_verts.data() + (i * 3 + 0) * vert_stride, &v0, sizeof(float3));
+            std::memcpy(light_verts.data() + (i * 3 + 1) * vert_stride, &v1, sizeof(float3));
+            std::memcpy(light_verts.data() + (i * 3 + 2) * vert_stride, &v2, sizeof(float3));
+            std::memcpy(light_norms.data() + i * norm_stride, &n, sizeof(float3));
+            std::memcpy(light_areas.data() + i * sizeof(float), &inv_area, sizeof(float));
+        }
+        auto table = build_alias_table(weights);
+        std::memcpy(light_select.data(), table.data(), light_select.size());
+
+        refit_buffers["data/light_verts.bin"]  = std::move(light_verts);
+        refit_buffers["data/light_norms.bin"]  = std::move(light_norms);
+        refit_buffers["data/light_areas.bin"]  = std::move(light_areas);
+        refit_buffers["data/light_select.bin"] = std::move(light_select);
+    }
+
+    // Replaces the vertex positions of the scene by those in the given buffer file, which must have the layout
+    // of data/vertices.bin, and refits the BVHs. The face normals, areas and lights are updated, but the vertex normals
+    // are kept. BVHs that are not loaded yet are refitted when loaded. Returns the largest increase of the SAH
+    // cost of a BVH, relative to the BVH built by the generator.
+    float refit(const std::string& filename) {
+        auto vertices     = read_host_buffer(filename);
+        auto old_vertices = read_host_buffer("data/vertices.bin");
+        auto face_normals = read_host_buffer("data/face_normals.bin");
+        auto face_area    = read_host_buffer("data/face_area.bin");
+        auto indices      = read_host_buffer("data/indices.bin");
+        if (vertices.size() != old_vertices.size())
+            error("The vertices in '", filename, "' do not match those of the scene");
+
+        // Elements are padded to 16 bytes for GPU targets, which is detected with the size of the indices
+        // relative to that of the face normals (4 indices per triangle, each padded, against one normal)
+        bool padded = face_normals.size() > 0 && indices.size() == 4 * face_normals.size();
+        auto stride       = padded ? 4 * sizeof(float) : sizeof(float3);
+        auto index_stride = padded ? 4 * sizeof(uint32_t) : sizeof(uint32_t);
+        auto num_tris     = indices.size() / (4 * index_stride);
+        auto area_stride  = num_tris > 0 ? face_area.size() / num_tris : sizeof(float);
+        if (face_normals.size() != num_tris * stride || face_area.size() != num_tris * area_stride || area_stride < sizeof(float))
+            error("The scene buffers have inconsistent sizes");
+        auto num_vertices = vertices.size() / stride;
+        std::vector<float3> old_positions(num_vertices);
+        refit_vertices.resize(num_vertices);
+        for (size_t i = 0; i < num_vertices; ++i) {
+            std::memcpy(&refit_vertices[i], vertices.data() + i * stride, sizeof(float3));
+            std::memcpy(&old_positions[i], old_vertices.data() + i * stride, sizeof(float3));
+        }
+        refit_indices.resize(num_tris * 4);
+        for (size_t i = 0; i < num_tris * 4; ++i)
+            std::memcpy(&refit_indices[i], indices.data() + i * index_stride, sizeof(uint32_t));
+
+        std::vector<float3> normals(num_tris);
+        std::vector<float> areas(num_tris);
+        mesh::compute_face_normals(refit_indices, refit_vertices, normals, areas, 0);
+        for (size_t i = 0; i < num_tris; ++i) {
+            // Keep the orientation of the normals that have been flipped by the generator
+            auto& v0 = old_positions[refit_indices[i * 4 + 0]];
+            auto& v1 = old_positions[refit_indices[i * 4 + 1]];
+            auto& v2 = old_positions[refit_indices[i * 4 + 2]];
+            float3 old_normal;
+            std::memcpy(&old_normal, face_normals.data() + i * stride, sizeof(float3));
+            if (dot(old_normal, cross(v1 - v0, v2 - v0)) < 0.0f)
+                normals[i] = -normals[i];
+            std::memcpy(face_normals.data() + i * stride, &normals[i], sizeof(float3));
+        }
+        for (size_t i = 0; i < num_tris; ++i)
+            std::memcpy(face_area.data() + i * area_stride, &areas[i], sizeof(float));
+        refit_lights(old_positions);
+
+        refit_buffers["data/vertices.bin"]     = std::move(vertices);
+        refit_buffers["data/face_normals.bin"] = std::move(face_normals);
+        refit_buffers["data/face_area.bin"]    = std::move(face_area);
+
+        float max_cost = 1.0f;
+        for (auto& pair : devices) {
+            auto dev = pair.first;
+            auto& device = pair.second;
+            if (!device.bvh4_instances.empty() || !device.bvh8_instances.empty())
+                error("Scenes with instances cannot be refitted");
+            for (auto& bvh : device.bvh2_tri1) max_cost = std::max(max_cost, refit_bvh(dev, bvh.second));
+            for (auto& bvh : device.bvh4_tri4) max_cost = std::max(max_cost, refit_bvh(dev, bvh.second));
+            for (auto& bvh : device.bvh8_tri4) max_cost = std::max(max_cost, refit_bvh(dev, bvh.second));
+            // The buffers are loaded again with the new contents
+            for (auto& buffer : refit_buffers)
+                device.buffers.erase(buffer.first);
+        }
+        return max_cost;
+    }
+
+    const DeviceBuffer<uint8_t>& load_buffer(int32_t dev, const std::string& filename) {
         auto& buffers = devices[dev].buffers;
         auto it = buffers.find(filename);
         if (it != buffers.end())
             return it->second;
-        std::ifstream is(filename, std::ios::binary);
-        if (!is)
+        auto refit = refit_buffers.find(filename);
+        if (refit != refit_buffers.end()) {
+            auto& buffer = buffers[filename];
+            buffer.array = std::move(copy_to_device(dev, refit->second));
+            buffer.ptr   = buffer.array.data();
+            buffer.size  = refit->second.size();
+            return buffer;
+        }
+        MappedFile file(filename);
+        if (!file.is_open())
             error("Cannot open buffer '", filename, "'");
-        std::vector<uint8_t> vector;
-        read_buffer(is, vector);
+        BufferView view;
+        if (!parse_buffer(file.data(), 0, file.size(), view))
+            error("Invalid buffer '", filename, "'");
+        auto& buffer = buffers[filename] = std::move(load_device_buffer<uint8_t>(dev, view, filename));
+        if (buffer.mapped)
+            mapped_files.emplace_back(std::move(file));
         info("Loaded buffer '", filename, "'");
-        return buffers[filename] = std::move(copy_to_device(dev, vector));
+        return buffer;
     }
 
     const DeviceImage& load_img(int32_t dev, const std::string& filename) {
@@ -486,10 +842,124 @@ struct Interface {
     }
 
     void present(int32_t dev) {
-        anydsl::copy(devices[dev].film_pixels, host_pixels);
+        if (dev != 0)
+            anydsl::copy(devices[dev].film_pixels, host_pixels);
+        // The film is converted to the display color space once per frame, not per sample
+        auto xyz = host_pixels.data();
+        for (size_t i = 0, n = film_width * film_height * 3; i < n; i += 3) {
+            auto rgb = xyz_to_srgb(float3(xyz[i + 0], xyz[i + 1], xyz[i + 2]));
+            display_pixels[i + 0] = rgb.x;
+            display_pixels[i + 1] = rgb.y;
+            display_pixels[i + 2] = rgb.z;
+        }
+    }
+    // Denoises the film, guided by the AOVs, and returns the result with the same scale as display_pixels
+    const float* denoise(uint32_t iter) {
+        auto n = film_width * film_height;
+        denoised_pixels.resize(n * 3);
+        denoiser.denoise(host_pixels.data(), aov_pixels.data(), film_width, film_height, 1.0f / iter, denoised_pixels.data());
+        for (size_t i = 0; i < n * 3; i += 3) {
+            auto rgb = xyz_to_srgb(float3(denoised_pixels[i + 0], denoised_pixels[i + 1], denoised_pixels[i + 2]));
+            denoised_pixels[i + 0] = rgb.x * iter;
+            denoised_pixels[i + 1] = rgb.y * iter;
+            denoised_pixels[i + 2] = rgb.z * iter;
+        }
+        return denoised_pixels.data();
+    }
+
+    void clear_aovs() {
+        for (size_t i = 0; i < aov_pixels.size(); i += 8) {
+            std::fill(aov_pixels.begin() + i, aov_pixels.begin() + i + 7, 0.0f);
+            aov_pixels[i + 7] = -1.0f;
+        }
     }
+
+    static void get_checkpoint_camera(const Settings& settings, float (&camera)[14]) {
+        const Vec3* vecs[] = { &settings.eye, &settings.dir, &settings.up, &settings.right };
+        for (int i = 0; i < 4; ++i) {
+            camera[i * 3 + 0] = vecs[i]->x;
+            camera[i * 3 + 1] = vecs[i]->y;
+            camera[i * 3 + 2] = vecs[i]->z;
+        }
+        camera[12] = settings.width;
+        camera[13] = settings.height;
+    }
+
+    // The file is written next to the destination and then renamed, so that an interrupted write never corrupts the last checkpoint
+    void save_checkpoint(const std::string& filename, const Settings& settings, uint32_t iter) {
+        CheckpointHeader header = {};
+        header.magic = checkpoint_magic;
+        header.version = checkpoint_version;
+        header.width = film_width;
+        header.height = film_height;
+        header.iter = iter;
+        header.spp = get_spp();
+        header.adaptive_frames = adaptive_frames;
+        header.adaptive_threshold = adaptive_threshold;
+        header.aov_size = aov_pixels.size();
+        header.adaptive_size = adaptive_stats.size();
+        get_checkpoint_camera(settings, header.camera);
+
+        auto tmp_filename = filename + ".tmp";
+        {
+            std::ofstream os(tmp_filename, std::ofstream::binary);
+            os.write((const char*)&header, sizeof(CheckpointHeader));
+            os.write((const char*)host_pixels.data(), sizeof(float) * film_width * film_height * 3);
+            os.write((const char*)aov_pixels.data(), sizeof(float) * aov_pixels.size());
+            os.write((const char*)adaptive_stats.data(), sizeof(float) * adaptive_stats.size());
+            if (!os)
+                error("Cannot write checkpoint '", tmp_filename, "'");
+        }
+#ifdef _WIN32
+        std::remove(filename.c_str());
+#endif
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+            error("Cannot rename checkpoint '", tmp_filename, "' to '", filename, "'");
+    }
+
+    // The options that change the result of a frame must be the same as when the checkpoint was written
+    uint32_t load_checkpoint(const std::string& filename, const Settings& settings) {
+        std::ifstream is(filename, std::ifstream::binary);
+        CheckpointHeader header;
+        if (!is.read((char*)&header, sizeof(CheckpointHeader)) || header.magic != checkpoint_magic)
+            error("Invalid checkpoint '", filename, "'");
+        if (header.version != checkpoint_version)
+            error("Unsupported checkpoint version ", header.version, " in '", filename, "'");
+
+        float camera[14];
+        get_checkpoint_camera(settings, camera);
+        if (header.width != film_width || header.height != film_height)
+            error("Checkpoint '", filename, "' was rendered at ", header.width, "x", header.height);
+        if (header.spp != get_spp())
+            error("Checkpoint '", filename, "' was rendered with ", header.spp, " samples per frame");
+        if (std::memcmp(camera, header.camera, sizeof(camera)) != 0)
+            error("Checkpoint '", filename, "' was rendered with another camera");
+        if (header.aov_size != aov_pixels.size() || header.adaptive_threshold != adaptive_threshold)
+            error("Checkpoint '", filename, "' was rendered with other AOV or adaptive sampling options");
+
+        adaptive_stats.resize(header.adaptive_size);
+        is.read((char*)host_pixels.data(), sizeof(float) * film_width * film_height * 3);
+        is.read((char*)aov_pixels.data(), sizeof(float) * aov_pixels.size());
+        is.read((char*)adaptive_stats.data(), sizeof(float) * adaptive_stats.size());
+        if (!is)
+            error("Checkpoint '", filename, "' is truncated");
+        adaptive_frames = header.adaptive_frames;
+
+        for (auto& pair : devices) {
+            auto& device_pixels = devices[pair.first].film_pixels;
+            if (device_pixels.size())
+                anydsl::copy(host_pixels, device_pixels);
+        }
+        present(0);
+        return header.iter;
+    }
+
     void clear() {
         std::fill(host_pixels.begin(), host_pixels.end(), 0.0f);
+        std::fill(display_pixels.begin(), display_pixels.end(), 0.0f);
+        std::fill(adaptive_stats.begin(), adaptive_stats.end(), 0.0f);
+        adaptive_frames = 0;
+        clear_aovs();
         for (auto& pair : devices) {
             auto& device_pixels = devices[pair.first].film_pixels;
             if (device_pixels.size())
@@ -500,6 +970,8 @@ struct Interface {
 
 thread_local anydsl::Array<float> Interface::cpu_primary;
 thread_local anydsl::Array<float> Interface::cpu_secondary;
+thread_local anydsl::Array<float> Interface::cpu_spare_primary;
+thread_local anydsl::Array<int32_t> Interface::cpu_tmp;
 
 static std::unique_ptr<Interface> interface;
 
@@ -512,13 +984,72 @@ void cleanup_interface() {
 }
 
 float* get_pixels() {
-    return interface->host_pixels.data();
+    return interface->display_pixels.data();
 }
 
 void clear_pixels() {
     return interface->clear();
 }
 
+void set_profiling_mode(int32_t mode) {
+    interface->profiling_mode = mode;
+}
+
+void get_profile(ProfileCounters& counters) {
+    counters = interface->profile;
+    interface->profile = ProfileCounters {};
+}
+
+void set_adaptive_threshold(float threshold) {
+    interface->adaptive_threshold = threshold;
+}
+
+void enable_aovs() {
+    interface->aov_pixels.resize(interface->film_width * interface->film_height * 8);
+    interface->clear_aovs();
+}
+
+const float* get_aov_pixels() {
+    return interface->aov_pixels.empty() ? nullptr : interface->aov_pixels.data();
+}
+
+/// Returns nullptr when the AOVs are disabled or no sample has been rendered yet
+const float* get_denoised_pixels(uint32_t iter) {
+    // The denoiser needs the AOVs to find the edges in the image
+    return interface->aov_pixels.empty() || iter == 0 ? nullptr : interface->denoise(iter);
+}
+
+float refit_scene(const std::string& vertices_file) {
+    return interface->refit(vertices_file);
+}
+
+void save_checkpoint(const std::string& filename, const Settings& settings, uint32_t iter) {
+    interface->save_checkpoint(filename, settings, iter);
+}
+
+uint32_t load_checkpoint(const std::string& filename, const Settings& settings) {
+    return interface->load_checkpoint(filename, settings);
+}
+
+// Must be called before any worker thread is started: the threads inherit the affinity of the main thread
+void set_thread_affinity(const std::vector<int>& cores) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto core : cores) {
+        if (core < 0 || core >= CPU_SETSIZE)
+            error("Invalid core index ", core, " in the thread affinity");
+        CPU_SET(core, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        error("Cannot set the thread affinity: ", std::strerror(errno));
+    info("Threads restricted to ", CPU_COUNT(&set), " core(s)");
+#else
+    (void)cores;
+    warn("Thread affinity is not supported on this platform");
+#endif
+}
+
 inline void get_ray_stream(RayStream& rays, float* ptr, size_t capacity) {
     rays.id         = (int*)ptr + 0 * capacity;
     rays.org_x      = ptr + 1 * capacity;
@@ -542,13 +1073,15 @@ inline void get_primary_stream(PrimaryStream& primary, float* ptr, size_t capaci
     primary.t         = ptr + (RAY_STREAM_SIZE+2) * capacity;
     primary.u         = ptr + (RAY_STREAM_SIZE+3) * capacity;
     primary.v         = ptr + (RAY_STREAM_SIZE+4) * capacity;
-    primary.rnd       = (unsigned int*)ptr + (RAY_STREAM_SIZE+5) * capacity;
-    primary.mis       = ptr + (RAY_STREAM_SIZE+6) * capacity;
-    primary.contrib_hero = ptr + (RAY_STREAM_SIZE+7) * capacity;
-    primary.contrib_s1 = ptr + (RAY_STREAM_SIZE+8) * capacity;
-    primary.contrib_s2 = ptr + (RAY_STREAM_SIZE+9) * capacity;
-    primary.contrib_s3 = ptr + (RAY_STREAM_SIZE+10) * capacity;
-    primary.depth     = (int*)ptr + (RAY_STREAM_SIZE+11) * capacity;
+    // The sampler state is 64 bits wide and takes two slots (the offset in bytes is a multiple of 8)
+    primary.rnd       = (uint64_t*)(ptr + (RAY_STREAM_SIZE+5) * capacity);
+    primary.mis       = ptr + (RAY_STREAM_SIZE+7) * capacity;
+    primary.contrib_hero = ptr + (RAY_STREAM_SIZE+8) * capacity;
+    primary.contrib_s1 = ptr + (RAY_STREAM_SIZE+9) * capacity;
+    primary.contrib_s2 = ptr + (RAY_STREAM_SIZE+10) * capacity;
+    primary.contrib_s3 = ptr + (RAY_STREAM_SIZE+11) * capacity;
+    primary.depth     = (int*)ptr + (RAY_STREAM_SIZE+12) * capacity;
+    primary.inst_id   = (int*)ptr + (RAY_STREAM_SIZE+13) * capacity;
     primary.size = 0;
 }
 
@@ -589,8 +1122,8 @@ void rodent_load_img(int32_t dev, const char* file, float** pixels, int32_t* wid
 }
 
 uint8_t* rodent_load_buffer(int32_t dev, const char* file) {
-    auto& array = interface->load_buffer(dev, file);
-    return const_cast<uint8_t*>(array.data());
+    auto& buffer = interface->load_buffer(dev, file);
+    return const_cast<uint8_t*>(buffer.data());
 }
 
 void rodent_load_bvh2_tri1(int32_t dev, const char* file, Node2** nodes, Tri1** tris) {
@@ -611,6 +1144,18 @@ void rodent_load_bvh8_tri4(int32_t dev, const char* file, Node8** nodes, Tri4**
     *tris  = const_cast<Tri4*>(bvh.tris.data());
 }
 
+void rodent_load_bvh4_instances(int32_t dev, const char* file, Node4** nodes, Instance** instances) {
+    auto& bvh = interface->load_bvh4_instances(dev, file);
+    *nodes     = const_cast<Node4*>(bvh.nodes.data());
+    *instances = const_cast<Instance*>(bvh.tris.data());
+}
+
+void rodent_load_bvh8_instances(int32_t dev, const char* file, Node8** nodes, Instance** instances) {
+    auto& bvh = interface->load_bvh8_instances(dev, file);
+    *nodes     = const_cast<Node8*>(bvh.nodes.data());
+    *instances = const_cast<Instance*>(bvh.tris.data());
+}
+
 void rodent_cpu_get_primary_stream(PrimaryStream* primary, int32_t size) {
     auto& array = interface->cpu_primary_stream(size);
     get_primary_stream(*primary, array.data(), array.size() / PRIMARY_SIZE);
@@ -621,6 +1166,25 @@ void rodent_cpu_get_secondary_stream(SecondaryStream* secondary, int32_t size) {
     get_secondary_stream(*secondary, array.data(), array.size() / SECONDARY_SIZE);
 }
 
+void rodent_cpu_get_spare_primary_stream(PrimaryStream* primary, int32_t size) {
+    auto& array = interface->cpu_spare_primary_stream(size);
+    get_primary_stream(*primary, array.data(), array.size() / PRIMARY_SIZE);
+}
+
+void rodent_cpu_get_tmp_buffer(int32_t** buf, int32_t size) {
+    *buf = interface->cpu_tmp_buffer(size).data();
+}
+
+int32_t rodent_cpu_thread_count() {
+#ifdef __linux__
+    // Only count the cores that this process is allowed to run on
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        return std::max(CPU_COUNT(&set), 1);
+#endif
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
 void rodent_gpu_get_tmp_buffer(int32_t dev, int32_t** buf, int32_t size) {
     *buf = interface->gpu_tmp_buffer(dev, size).data();
 }
@@ -651,18 +1215,51 @@ void rodent_cpu_intersect_secondary_embree(SecondaryStream* secondary) {
 #endif
 
 void rodent_present(int32_t dev) {
-    if (dev != 0)
-        interface->present(dev);
+    interface->present(dev);
+}
+
+int32_t rodent_profiling_mode() {
+    return interface->profiling_mode;
+}
+
+int32_t rodent_get_aov_data(float** pixels) {
+    *pixels = interface->aov_pixels.data();
+    return interface->aov_pixels.empty() ? 0 : 1;
+}
+
+int32_t rodent_begin_adaptive_frame(float** stats, float* threshold) {
+    auto& adaptive_stats = interface->adaptive_stats;
+    *threshold = interface->adaptive_threshold;
+    if (interface->adaptive_threshold <= 0.0f) {
+        // Adaptive sampling is disabled: no statistics are kept, so that checkpoints do not store them
+        std::vector<float>().swap(adaptive_stats);
+        interface->adaptive_frames = 0;
+        *stats = nullptr;
+        return 0;
+    }
+    if (adaptive_stats.empty())
+        adaptive_stats.resize(interface->film_width * interface->film_height * 4, 0.0f);
+    *stats = adaptive_stats.data();
+    return interface->adaptive_frames++;
+}
+
+void rodent_report_profile(const ProfileCounters* counters) {
+    auto& profile = interface->profile;
+    profile.generation   += counters->generation;
+    profile.primary      += counters->primary;
+    profile.bounces      += counters->bounces;
+    profile.sort         += counters->sort;
+    profile.shade        += counters->shade;
+    profile.compaction   += counters->compaction;
+    profile.shadow       += counters->shadow;
+    profile.accumulation += counters->accumulation;
+    profile.total        += counters->total;
+    profile.rays         += counters->rays;
 }
 
 int64_t clock_us() {
-#if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
-#define CPU_FREQ 4e9
-    __asm__ __volatile__("xorl %%eax,%%eax \n    cpuid" ::: "%rax", "%rbx", "%rcx", "%rdx");
-    return __rdtsc() * int64_t(1000000) / int64_t(CPU_FREQ);
-#else
-    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
-#endif
+    // The steady clock is monotonic and does not depend on the frequency of the processor
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 } // extern "C"
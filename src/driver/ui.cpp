@@ -5,6 +5,11 @@
 #include <chrono>
 #include <ctime>
 #include <iomanip>
+#include <cstring>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 
 #include <SDL.h>
 #include "imgui.h"
@@ -27,19 +32,6 @@ static std::vector<uint32_t> sBuffer;
 static int sWidth;
 static int sHeight;
 
-struct CameraPose {
-    float3 Eye = float3(0,0,0);
-    float3 Dir = float3(0,0,1);
-    float3 Up  = float3(0,1,0);
-
-    inline CameraPose() = default;
-    inline explicit CameraPose(const Camera& cam)
-        : Eye(cam.eye)
-        , Dir(cam.dir)
-        , Up(cam.up)
-    {}
-};
-
 struct LuminanceInfo {
     float Min = std::numeric_limits<float>::infinity();
     float Max = 0.0f;
@@ -51,6 +43,7 @@ static int sPoseRequest = -1;
 static bool sScreenshotRequest = false;
 static bool sShowUI = true;
 static bool sLockInteraction = false;
+static bool sDenoise = false;
 
 // Stats
 static LuminanceInfo sLastLum;
@@ -65,25 +58,12 @@ static float sToneMapping_Offset   = 0.0f;
 
 // Interface
 float* get_pixels();
+const float* get_denoised_pixels(uint32_t);
 
 // Pose IO
 static std::array<CameraPose, 10> sCameraPoses;
 constexpr char POSE_FILE[] = "data/poses.lst";
 
-static CameraPose read_pose(std::istream& in) {
-    CameraPose pose;
-    in >> pose.Eye[0] >> pose.Eye[1] >> pose.Eye[2];
-    in >> pose.Dir[0] >> pose.Dir[1] >> pose.Dir[2];
-    in >> pose.Up[0] >> pose.Up[1] >> pose.Up[2];
-    return pose;
-}
-
-static void write_pose(const CameraPose& pose, std::ostream& out) {
-    out << pose.Eye[0] << " " << pose.Eye[1] << " " << pose.Eye[2];
-    out << " " << pose.Dir[0] << " " << pose.Dir[1] << " " << pose.Dir[2];
-    out << " " << pose.Up[0] << " " << pose.Up[1] << " " << pose.Up[2];
-}
-
 inline bool file_exists(const std::string& name) {
     return std::ifstream(name.c_str()).good();
 }
@@ -201,6 +181,7 @@ static bool handle_events(uint32_t& iter, Camera& cam) {
                             case SDLK_t:        sToneMapping_Automatic = !sToneMapping_Automatic; break;
                             case SDLK_F2:       sShowUI = !sShowUI; break;
                             case SDLK_F3:       sLockInteraction = !sLockInteraction; break;
+                            case SDLK_n:        sDenoise = !sDenoise; break;
                             case SDLK_F11:      sScreenshotRequest = true; break;
                         }
 
@@ -271,8 +252,7 @@ static bool handle_events(uint32_t& iter, Camera& cam) {
     }
 
     if(sPoseRequest >= 0) {
-        cam.eye = sCameraPoses[sPoseRequest].Eye;
-        cam.update_dir(sCameraPoses[sPoseRequest].Dir, sCameraPoses[sPoseRequest].Up);
+        sCameraPoses[sPoseRequest].apply(cam);
         iter = 0;
         sPoseRequest = -1;
     }
@@ -285,68 +265,143 @@ static bool handle_events(uint32_t& iter, Camera& cam) {
 // ToneMapping
 #define RGB_C(r,g,b) (((r) << 16) | ((g) << 8) | (b))
 
-static inline rgb xyz_to_srgb(const rgb& c) {
-    return rgb(  3.2404542f*c.x - 1.5371385f*c.y - 0.4985314f*c.z, 
-                -0.9692660f*c.x + 1.8760108f*c.y + 0.0415560f*c.z,
-                 0.0556434f*c.x - 0.2040259f*c.y + 1.0572252f*c.z);
+// Factor applied to a color of luminance L by the tone mapping operator: (L*(1+L/W^2))/(1+L), divided by L
+static inline float reinhard_modified_scale(float L) {
+    constexpr float WhitePoint = 4.0f;
+    return (1.0f+L/(WhitePoint*WhitePoint))/(1.0f+L);
 }
 
-static inline rgb srgb_to_xyz(const rgb& c) {
-    return rgb( 0.4124564f*c.x + 0.3575761f*c.y + 0.1804375f*c.z,
-                0.2126729f*c.x + 0.7151522f*c.y + 0.0721750f*c.z,
-                0.0193339f*c.x + 0.1191920f*c.y + 0.9503041f*c.z);
-}
+// Converts linear values to 8-bit display values with a gamma of 2.2, without calling std::pow for every pixel.
+// The table is indexed by the exponent and the first bits of the mantissa of the value: within one entry, the
+// result changes by at most one step, so one comparison with the threshold of the next step is enough. The thresholds
+// are computed with std::pow in the other direction, so the result may differ by one output level from the direct formula.
+class GammaTable {
+public:
+    GammaTable() {
+        for (int k = 0; k < 256; ++k)
+            thresholds_[k] = std::pow(k / 255.0f, 2.2f);
+        thresholds_[256] = std::numeric_limits<float>::infinity();
+
+        int k = 0;
+        for (size_t i = 0; i < TABLE_SIZE; ++i) {
+            uint32_t bits = (uint32_t(127 + MIN_EXPONENT) << 23) + uint32_t(i << (23 - MANTISSA_BITS));
+            float x;
+            std::memcpy(&x, &bits, sizeof(float));
+            while (x >= thresholds_[k + 1]) k++;
+            table_[i] = k;
+        }
+    }
+
+    inline uint32_t operator () (float x) const {
+        // Values out of range and NaNs are clamped with min and max, which do not need branches
+        x = std::min(std::max(float(MIN_VALUE), x), 1.0f);
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(float));
+        uint32_t k = table_[(bits >> (23 - MANTISSA_BITS)) - (uint32_t(127 + MIN_EXPONENT) << MANTISSA_BITS)];
+        return k + (x >= thresholds_[k + 1] ? 1 : 0);
+    }
+
+private:
+    static constexpr int MIN_EXPONENT = -18;    // Values below 2^-18 are all mapped to 0 (the first threshold is above)
+    static constexpr int MANTISSA_BITS = 9;
+    static constexpr size_t TABLE_SIZE = (size_t(-MIN_EXPONENT) << MANTISSA_BITS) + 1; // The last entry is for 1
+    static constexpr float MIN_VALUE = 1.0f / (1 << -MIN_EXPONENT);
+
+    float thresholds_[257];
+    uint32_t table_[TABLE_SIZE];    // 32-bit entries, which can be gathered with vector instructions
+};
+
+static const GammaTable sGammaTable;
+
+// Luminance of the film, one value per pixel, computed once per frame
+static std::vector<float> sLuminance;
 
-static inline rgb xyY_to_srgb(const rgb& c) {
-    return c.y == 0 ? rgb(0,0,0) : xyz_to_srgb(rgb(c.x*c.z/c.y, c.z, (1-c.x-c.y)*c.z/c.y));
+static inline float luminance(const float* rgb) {
+    return 0.2126729f * rgb[0] + 0.7151522f * rgb[1] + 0.0721750f * rgb[2];
 }
 
-static inline rgb srgb_to_xyY(const rgb& c) {
-    const auto s = srgb_to_xyz(c);
-    const auto n = s.x+s.y+s.z;
-    return (n == 0)?rgb(0,0,0):rgb(s.x/n, s.y/n, s.y);
+static inline void sort2(float& a, float& b) {
+    auto t = std::min(a, b);
+    b = std::max(a, b);
+    a = t;
 }
 
-static inline float reinhard_modified(float L) {
-    constexpr float WhitePoint = 4.0f;
-    return (L*(1.0f+L/(WhitePoint*WhitePoint)))/(1.0f+L);
+// Median of 9 values with a sorting network, which has no branches
+static inline float median9(float p0, float p1, float p2, float p3, float p4, float p5, float p6, float p7, float p8) {
+    sort2(p1, p2); sort2(p4, p5); sort2(p7, p8);
+    sort2(p0, p1); sort2(p3, p4); sort2(p6, p7);
+    sort2(p1, p2); sort2(p4, p5); sort2(p7, p8);
+    sort2(p0, p3); sort2(p5, p8); sort2(p4, p7);
+    sort2(p3, p6); sort2(p1, p4); sort2(p2, p5);
+    sort2(p4, p7); sort2(p4, p2); sort2(p6, p4);
+    sort2(p4, p2);
+    return p4;
 }
 
-static void analzeLuminance(size_t width, size_t height, uint32_t iter) {
-    const auto film = get_pixels();
+static void analzeLuminance(const float* film, size_t width, size_t height, uint32_t iter) {
     auto inv_iter = 1.0f / iter;
     const float avgFactor = 1.0f/(width*height);
+    sLuminance.resize(width * height);
+
+    // Extract basic information, in the same pass as the computation of the luminance
+    struct Stats {
+        float min = std::numeric_limits<float>::infinity();
+        float max = 0.0f;
+        double sum = 0.0;
+    };
+    auto stats = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, height), Stats(),
+        [&] (const tbb::blocked_range<size_t>& range, Stats stats) {
+            for (size_t y = range.begin(); y != range.end(); ++y) {
+                auto row = sLuminance.data() + y * width;
+                float min = stats.min, max = stats.max, sum = 0.0f;
+                for (size_t x = 0; x < width; ++x) {
+                    const auto L = luminance(film + (y * width + x) * 3) * inv_iter;
+                    row[x] = L;
+                    max = std::max(max, L);
+                    min = std::min(min, L);
+                    sum += L;
+                }
+                stats.min = min;
+                stats.max = max;
+                stats.sum += sum;
+            }
+            return stats;
+        },
+        [] (const Stats& a, const Stats& b) {
+            Stats stats;
+            stats.min = std::min(a.min, b.min);
+            stats.max = std::max(a.max, b.max);
+            stats.sum = a.sum + b.sum;
+            return stats;
+        });
     sLastLum = LuminanceInfo();
+    sLastLum.Min = stats.min;
+    sLastLum.Max = stats.max;
+    sLastLum.Avg = stats.sum * avgFactor;
 
-    // Extract basic information
-    for (size_t y = 0; y < height; ++y) {
-        for (size_t x = 0; x < width; ++x) {
-            auto r = film[(y * width + x) * 3 + 0];
-            auto g = film[(y * width + x) * 3 + 1];
-            auto b = film[(y * width + x) * 3 + 2];
-
-            const auto L = srgb_to_xyY(rgb(r,g,b)).z * inv_iter;
-
-            sLastLum.Max = std::max(sLastLum.Max, L);
-            sLastLum.Min = std::min(sLastLum.Min, L);
-            sLastLum.Avg += L * avgFactor;
-        }
-    }
-
-    // Setup histogram
-    sHistogram.fill(0.0f);
+    // Setup histogram, with one count per block of rows
+    using Histogram = std::array<uint32_t, HISTOGRAM_SIZE>;
     const float histogram_factor = HISTOGRAM_SIZE/std::max(sLastLum.Max, 1.0f);
-    for (size_t y = 0; y < height; ++y) {
-        for (size_t x = 0; x < width; ++x) {
-            auto r = film[(y * width + x) * 3 + 0];
-            auto g = film[(y * width + x) * 3 + 1];
-            auto b = film[(y * width + x) * 3 + 2];
-
-            const auto L  = srgb_to_xyY(rgb(r,g,b)).z * inv_iter;
-            const int idx = std::max(0, std::min<int>(L * histogram_factor, HISTOGRAM_SIZE-1));
-            sHistogram[idx] += avgFactor;
-        }
-    }
+    Histogram empty;
+    empty.fill(0);
+    auto counts = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, height), empty,
+        [&] (const tbb::blocked_range<size_t>& range, Histogram counts) {
+            for (size_t y = range.begin(); y != range.end(); ++y) {
+                auto row = sLuminance.data() + y * width;
+                for (size_t x = 0; x < width; ++x) {
+                    const int idx = std::max(0, std::min<int>(row[x] * histogram_factor, HISTOGRAM_SIZE-1));
+                    counts[idx]++;
+                }
+            }
+            return counts;
+        },
+        [] (Histogram a, const Histogram& b) {
+            for (size_t i = 0; i < HISTOGRAM_SIZE; ++i)
+                a[i] += b[i];
+            return a;
+        });
+    for (size_t i = 0; i < HISTOGRAM_SIZE; ++i)
+        sHistogram[i] = counts[i] * avgFactor;
 
     // Estimate for reinhard
 #ifdef USE_MEDIAN_FOR_LUMINANCE_ESTIMATION
@@ -354,90 +409,108 @@ static void analzeLuminance(size_t width, size_t height, uint32_t iter) {
         sLastLum.Est = sLastLum.Max;
         return;
     }
-    constexpr size_t WINDOW_S = 3;
-    constexpr size_t EDGE_S = WINDOW_S/2;
-    std::array<float, WINDOW_S*WINDOW_S> window;
-
-    for (size_t y = EDGE_S; y < height-EDGE_S; ++y) {
-        for (size_t x = EDGE_S; x < width-EDGE_S; ++x) {
-
-            size_t i = 0;
-            for(size_t wy = 0; wy <WINDOW_S; ++wy) {
-                for(size_t wx = 0; wx <WINDOW_S; ++wx) {
-                    const auto ix = x + wx - EDGE_S;
-                    const auto iy = y + wy - EDGE_S;
-
-                    auto r = film[(iy * width + ix) * 3 + 0];
-                    auto g = film[(iy * width + ix) * 3 + 1];
-                    auto b = film[(iy * width + ix) * 3 + 2];
+    if (width < 3 || height < 3)
+        return;
 
-                    window[i] = srgb_to_xyY(rgb(r,g,b)).z;
-                    ++i;
+    // Maximum of the luminance after a 3x3 median filter
+    auto est = tbb::parallel_reduce(tbb::blocked_range<size_t>(1, height - 1), sLastLum.Est,
+        [&] (const tbb::blocked_range<size_t>& range, float est) {
+            for (size_t y = range.begin(); y != range.end(); ++y) {
+                auto r0 = sLuminance.data() + (y - 1) * width;
+                auto r1 = r0 + width;
+                auto r2 = r1 + width;
+                auto median = [&] (size_t x) {
+                    return median9(
+                        r0[x - 1], r0[x], r0[x + 1],
+                        r1[x - 1], r1[x], r1[x + 1],
+                        r2[x - 1], r2[x], r2[x + 1]);
+                };
+                // One maximum per lane, so that the compiler can vectorize the loop
+                constexpr size_t LANES = 8;
+                float lanes[LANES];
+                std::fill(lanes, lanes + LANES, est);
+                size_t x = 1;
+                for (; x + LANES <= width - 1; x += LANES) {
+                    for (size_t k = 0; k < LANES; ++k)
+                        lanes[k] = std::max(lanes[k], median(x + k));
                 }
+                for (; x < width - 1; ++x)
+                    est = std::max(est, median(x));
+                for (size_t k = 0; k < LANES; ++k)
+                    est = std::max(est, lanes[k]);
             }
-
-            std::sort(window.begin(), window.end());
-            const auto L = window[window.size()/2];
-            sLastLum.Est = std::max(sLastLum.Est, L * inv_iter);
-        }
-    }
+            return est;
+        },
+        [] (float a, float b) { return std::max(a, b); });
+    sLastLum.Est = est;
 #else
     sLastLum.Est = sLastLum.Max;
 #endif
 }
 
 static void update_texture(uint32_t* buf, SDL_Texture* texture, size_t width, size_t height, uint32_t iter) {
-    auto film = get_pixels();
-    auto inv_iter = 1.0f / iter;
-    auto inv_gamma = 1.0f / 2.2f;
-    
-    const float avgFactor = 1.0f/(width*height);
-    
+    // Denoising only affects the display, and is unavailable when the AOVs are not recorded
+    const float* film = sDenoise ? get_denoised_pixels(iter) : nullptr;
+    if (!film)
+        film = get_pixels();
+    const float inv_iter = 1.0f / iter;
+
     const float exposure_factor = std::pow(2.0, sToneMapping_Exposure);
-    analzeLuminance(width, height, iter);
+    const float offset = sToneMapping_Offset;
+    const bool automatic = sToneMapping_Automatic;
+    analzeLuminance(film, width, height, iter);
+    const float inv_est = 1.0f / sLastLum.Est;
+
+    // Every row goes through a few simple loops without branches, on plain floats, so that the compiler can vectorize them
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, height), [&] (const tbb::blocked_range<size_t>& range) {
+        std::vector<float> colors(width * 3);
+        std::vector<uint32_t> pixels(width);
+        for (size_t y = range.begin(); y != range.end(); ++y) {
+            const float* in = film + y * width * 3;
+            const float* lum = sLuminance.data() + y * width;
+            uint32_t* out = buf + y * width;
+
+            if (automatic) {
+                // Changing the luminance while keeping the chromaticity is a scaling in any linear color space
+                for (size_t x = 0; x < width; ++x) {
+                    const float scale = inv_iter * inv_est * reinhard_modified_scale(lum[x] * inv_est);
+                    colors[x * 3 + 0] = in[x * 3 + 0] * scale;
+                    colors[x * 3 + 1] = in[x * 3 + 1] * scale;
+                    colors[x * 3 + 2] = in[x * 3 + 2] * scale;
+                }
+            } else {
+                const float factor = exposure_factor * inv_iter;
+                for (size_t x = 0; x < width * 3; ++x)
+                    colors[x] = in[x] * factor + offset;
+            }
 
-    for (size_t y = 0; y < height; ++y) {
-        for (size_t x = 0; x < width; ++x) {
-            auto r = film[(y * width + x) * 3 + 0] * inv_iter;
-            auto g = film[(y * width + x) * 3 + 1] * inv_iter;
-            auto b = film[(y * width + x) * 3 + 2] * inv_iter;
+            for (size_t x = 0; x < width; ++x)
+                pixels[x] = (sGammaTable(colors[x * 3 + 0]) << 16) | (sGammaTable(colors[x * 3 + 1]) << 8) | sGammaTable(colors[x * 3 + 2]);
 
-            const auto xyY = srgb_to_xyY(rgb(r,g,b));
+            for (size_t x = 0; x < width; ++x) {
+                uint32_t pixel = pixels[x];
 #ifdef CULL_BAD_COLOR
-            if(std::isinf(xyY.z)) {
-#ifdef CATCH_BAD_COLOR
-                buf[y * width + x] = RGB_C(255, 0, 150);//Pink
-#endif
-                continue;
-            } else if(std::isnan(xyY.z)) {
+                // Same tests as on the xyY coordinates of the color, but without divisions
+                const float r = in[x * 3 + 0], g = in[x * 3 + 1], b = in[x * 3 + 2];
+                const float X = 0.4124564f*r + 0.3575761f*g + 0.1804375f*b;
+                const float Y = 0.2126729f*r + 0.7151522f*g + 0.0721750f*b;
+                const float Z = 0.0193339f*r + 0.1191920f*g + 0.9503041f*b;
+                const float n = X + Y + Z;
+                const bool is_nan = Y != Y;
+                const bool is_inf = std::abs(Y) == std::numeric_limits<float>::infinity();
+                const bool is_neg = (X * n < 0.0f) | (Y * n < 0.0f) | (Y < 0.0f);
 #ifdef CATCH_BAD_COLOR
-                buf[y * width + x] = RGB_C(0, 255, 255);//Cyan
-#endif
-                continue;
-            } else if(xyY.x < 0.0f || xyY.y < 0.0f || xyY.z < 0.0f) {
-#ifdef CATCH_BAD_COLOR
-                buf[y * width + x] = RGB_C(255, 255, 0);//Orange
+                pixel = is_neg ? RGB_C(255, 255, 0) : pixel;    // Orange
+                pixel = is_nan ? RGB_C(0, 255, 255) : pixel;    // Cyan
+                pixel = is_inf ? RGB_C(255, 0, 150) : pixel;    // Pink
+#else
+                pixel = is_neg | is_nan | is_inf ? out[x] : pixel;
 #endif
-                continue;
-            }
 #endif
-
-            rgb color;
-            if(sToneMapping_Automatic) {
-                const float L = xyY.z / sLastLum.Est;
-                color = xyY_to_srgb(rgb(xyY.x, xyY.y, reinhard_modified(L)));
-            } else {
-                color = rgb(exposure_factor * r + sToneMapping_Offset,
-                            exposure_factor * g + sToneMapping_Offset,
-                            exposure_factor * b + sToneMapping_Offset);
+                out[x] = pixel;
             }
-
-            buf[y * width + x] =
-                (uint32_t(clamp(std::pow(color.x, inv_gamma), 0.0f, 1.0f) * 255.0f) << 16) |
-                (uint32_t(clamp(std::pow(color.y, inv_gamma), 0.0f, 1.0f) * 255.0f) << 8)  |
-                 uint32_t(clamp(std::pow(color.z, inv_gamma), 0.0f, 1.0f) * 255.0f);
         }
-    }
+    });
     SDL_UpdateTexture(texture, nullptr, buf, width * sizeof(uint32_t));
 }
 
@@ -556,6 +629,7 @@ static void handle_imgui(uint32_t iter) {
     
     if(ImGui::CollapsingHeader("ToneMapping", ImGuiTreeNodeFlags_DefaultOpen)) {
         ImGui::Checkbox("Automatic", &sToneMapping_Automatic);
+        ImGui::Checkbox("Denoise (requires --aov)", &sDenoise);
         if(!sToneMapping_Automatic) {
             ImGui::SliderFloat("Exposure", &sToneMapping_Exposure, 0.01f, 10.0f);
             ImGui::SliderFloat("Offset", &sToneMapping_Offset, 0.0f, 10.0f);
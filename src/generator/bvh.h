@@ -10,6 +10,15 @@
 #endif
 
 #include "target.h"
+#include "hash.h"
+
+// Parameters of the SBVH builders: nodes with at most that many references become leaves,
+// and spatial splits are only tried when the overlap is larger than alpha times the area of the root
+static constexpr size_t bvh_leaf_threshold = 2;
+static constexpr float bvh_split_alpha = 1e-5f;
+// The instance BVH has one instance per leaf, and never splits instances
+static constexpr size_t instance_bvh_leaf_threshold = 1;
+static constexpr float instance_bvh_split_alpha = std::numeric_limits<float>::infinity();
 
 template <size_t N, size_t M>
 struct BvhNTriM
@@ -69,7 +78,7 @@ public:
 
     void build(const mesh::TriMesh &tri_mesh, const std::vector<::Tri> &tris)
     {
-        builder_.build(tris, NodeWriter(*this), LeafWriter(*this, tris, tri_mesh.indices), M / 2);
+        builder_.build(tris, NodeWriter(*this), LeafWriter(*this, tris, tri_mesh.indices), bvh_leaf_threshold, bvh_split_alpha);
     }
 
 #ifdef STATISTICS
@@ -231,7 +240,7 @@ public:
 
     void build(const mesh::TriMesh &tri_mesh, const std::vector<::Tri> &tris)
     {
-        builder_.build(tris, NodeWriter(*this), LeafWriter(*this, tris, tri_mesh.indices), 2);
+        builder_.build(tris, NodeWriter(*this), LeafWriter(*this, tris, tri_mesh.indices), bvh_leaf_threshold, bvh_split_alpha);
     }
 
 #ifdef STATISTICS
@@ -337,6 +346,147 @@ private:
     };
 };
 
+template <size_t N>
+struct BvhNInstance
+{
+};
+
+template <>
+struct BvhNInstance<8>
+{
+    using Node = Node8;
+};
+
+template <>
+struct BvhNInstance<4>
+{
+    using Node = Node4;
+};
+
+// Top-level BVH over instances: leaves contain the instance records, in the order of the BVH
+template <size_t N>
+class InstanceBvhAdapter
+{
+    struct CostFn
+    {
+        static float leaf_cost(int count, float area)
+        {
+            return count * area;
+        }
+        static float traversal_cost(float area)
+        {
+            return area;
+        }
+    };
+
+    using BvhBuilder = SplitBvhBuilder<N, CostFn>;
+    using Adapter = InstanceBvhAdapter;
+    using Node = typename BvhNInstance<N>::Node;
+
+    std::vector<Node> &nodes_;
+    std::vector<Instance> &instances_;
+    BvhBuilder builder_;
+
+public:
+    InstanceBvhAdapter(std::vector<Node> &nodes, std::vector<Instance> &instances)
+        : nodes_(nodes), instances_(instances)
+    {
+    }
+
+    void build(const std::vector<Instance> &instances, const std::vector<BBox> &bboxes)
+    {
+        // Every instance is given to the builder as a triangle that spans its bounding box.
+        // Spatial splits are disabled, so that instances are never referenced twice.
+        std::vector<::Tri> boxes(bboxes.size());
+        for (size_t i = 0; i < bboxes.size(); i++)
+            boxes[i] = ::Tri(bboxes[i].min, bboxes[i].max, (bboxes[i].min + bboxes[i].max) * 0.5f);
+        builder_.build(boxes, NodeWriter(*this), LeafWriter(*this, instances), instance_bvh_leaf_threshold, instance_bvh_split_alpha);
+    }
+
+private:
+    struct NodeWriter
+    {
+        Adapter &adapter;
+
+        NodeWriter(Adapter &adapter)
+            : adapter(adapter)
+        {
+        }
+
+        template <typename BBoxFn>
+        int operator()(int parent, int child, const BBox & /*parent_bb*/, size_t count, BBoxFn bboxes)
+        {
+            auto &nodes = adapter.nodes_;
+
+            size_t i = nodes.size();
+            nodes.emplace_back();
+
+            if (parent >= 0 && child >= 0)
+            {
+                assert(parent >= 0 && parent < nodes.size());
+                assert(child >= 0 && child < N);
+                nodes[parent].child[child] = i + 1;
+            }
+
+            assert(count >= 2 && count <= N);
+
+            for (size_t j = 0; j < count; j++)
+            {
+                const BBox &bbox = bboxes(j);
+                nodes[i].bounds[0][j] = bbox.min.x;
+                nodes[i].bounds[2][j] = bbox.min.y;
+                nodes[i].bounds[4][j] = bbox.min.z;
+
+                nodes[i].bounds[1][j] = bbox.max.x;
+                nodes[i].bounds[3][j] = bbox.max.y;
+                nodes[i].bounds[5][j] = bbox.max.z;
+            }
+
+            for (size_t j = count; j < N; ++j)
+            {
+                nodes[i].bounds[0][j] = std::numeric_limits<float>::infinity();
+                nodes[i].bounds[2][j] = std::numeric_limits<float>::infinity();
+                nodes[i].bounds[4][j] = std::numeric_limits<float>::infinity();
+
+                nodes[i].bounds[1][j] = -std::numeric_limits<float>::infinity();
+                nodes[i].bounds[3][j] = -std::numeric_limits<float>::infinity();
+                nodes[i].bounds[5][j] = -std::numeric_limits<float>::infinity();
+
+                nodes[i].child[j] = 0;
+            }
+
+            return i;
+        }
+    };
+
+    struct LeafWriter
+    {
+        Adapter &adapter;
+        const std::vector<Instance> &in_instances;
+
+        LeafWriter(Adapter &adapter, const std::vector<Instance> &in_instances)
+            : adapter(adapter), in_instances(in_instances)
+        {
+        }
+
+        template <typename RefFn>
+        void operator()(int parent, int child, const BBox & /*leaf_bb*/, size_t ref_count, RefFn refs)
+        {
+            auto &nodes = adapter.nodes_;
+            auto &instances = adapter.instances_;
+
+            nodes[parent].child[child] = ~instances.size();
+
+            for (size_t i = 0; i < ref_count; i++)
+                instances.emplace_back(in_instances[refs(i)]);
+
+            // Add sentinel
+            assert(ref_count > 0);
+            instances.back().inst_id |= 0x80000000;
+        }
+    };
+};
+
 template <typename T>
 inline std::vector<uint8_t> pad_buffer(const std::vector<T> &elems, bool enable, size_t size)
 {
@@ -386,10 +536,73 @@ inline void build_bvh(const mesh::TriMesh &tri_mesh,
     adapter.build(tri_mesh, in_tris);
 }
 
+// Node without children, which rays never enter
+template <typename Node, size_t N>
+inline Node make_empty_node()
+{
+    Node node{};
+    for (size_t j = 0; j < N; ++j)
+    {
+        node.bounds[0][j] = std::numeric_limits<float>::infinity();
+        node.bounds[2][j] = std::numeric_limits<float>::infinity();
+        node.bounds[4][j] = std::numeric_limits<float>::infinity();
+
+        node.bounds[1][j] = -std::numeric_limits<float>::infinity();
+        node.bounds[3][j] = -std::numeric_limits<float>::infinity();
+        node.bounds[5][j] = -std::numeric_limits<float>::infinity();
+
+        node.child[j] = 0;
+    }
+    return node;
+}
+
+// Appends the BVH of one mesh to an object-level BVH, and returns the root of the appended BVH.
+// The primitive identifiers of the mesh are offset by the index of its first triangle in the merged mesh.
+template <typename Node>
+inline int32_t append_bvh(std::vector<Node> &nodes, std::vector<Tri4> &tris,
+                          const std::vector<Node> &mesh_nodes, const std::vector<Tri4> &mesh_tris,
+                          uint32_t prim_offset)
+{
+    const int32_t node_offset = nodes.size();
+    const int32_t tri_offset = tris.size();
+    for (auto node : mesh_nodes)
+    {
+        for (auto &child : node.child)
+        {
+            if (child > 0)
+                child += node_offset;
+            else if (child < 0)
+                child = ~(~child + tri_offset);
+        }
+        nodes.emplace_back(node);
+    }
+    for (auto tri : mesh_tris)
+    {
+        for (auto &prim_id : tri.prim_id)
+        {
+            if (prim_id != -1)
+                prim_id = (((uint32_t)prim_id & 0x7FFFFFFF) + prim_offset) | ((uint32_t)prim_id & 0x80000000);
+        }
+        tris.emplace_back(tri);
+    }
+    return node_offset + 1;
+}
+
+template <size_t N>
+inline void build_instance_bvh(const std::vector<Instance> &in_instances, const std::vector<BBox> &bboxes,
+                               std::vector<typename BvhNInstance<N>::Node> &nodes,
+                               std::vector<Instance> &instances)
+{
+    InstanceBvhAdapter<N> adapter(nodes, instances);
+    adapter.build(in_instances, bboxes);
+}
+
 template <typename Node, typename Tri>
-inline void write_bvh(std::vector<Node> &nodes, std::vector<Tri> &tris)
+inline void write_bvh(std::vector<Node> &nodes, std::vector<Tri> &tris, const std::string &filename = "data/bvh.bin")
 {
-    std::ofstream of("data/bvh.bin", std::ios::app | std::ios::binary);
+    std::ofstream of(filename, std::ios::app | std::ios::binary);
+    // Uncompressed buffers are aligned relative to the beginning of the file
+    of.seekp(0, std::ios::end);
     size_t node_size = sizeof(Node);
     size_t tri_size = sizeof(Tri);
     of.write((char *)&node_size, sizeof(uint32_t));
@@ -399,20 +612,47 @@ inline void write_bvh(std::vector<Node> &nodes, std::vector<Tri> &tris)
     info("BVH with ", nodes.size(), " node(s), ", tris.size(), " tri(s)");
 }
 
-inline bool must_build_bvh(const std::string &name, Target target)
+// Version of the BVH builders, to be increased whenever their output changes
+static constexpr uint32_t bvh_builder_version = 3;
+
+// Hashes the mesh geometry along with the BVH variant, build parameters, and file format
+inline uint64_t bvh_stamp_hash(const mesh::TriMesh &tri_mesh, Target target, bool embree_bvh)
+{
+    uint32_t params[] = {
+        bvh_builder_version, uint32_t(target), uint32_t(embree_bvh), uint32_t(buffer_compression()),
+        uint32_t(bvh_leaf_threshold), uint32_t(instance_bvh_leaf_threshold)
+    };
+    float alphas[] = { bvh_split_alpha, instance_bvh_split_alpha };
+    uint64_t sizes[] = { tri_mesh.vertices.size(), tri_mesh.indices.size() };
+    auto h = hash_bytes(params, sizeof(params));
+    h = hash_bytes(alphas, sizeof(alphas), h);
+    h = hash_bytes(sizes, sizeof(sizes), h);
+    h = hash_bytes(tri_mesh.vertices.data(), sizeof(float3) * tri_mesh.vertices.size(), h);
+    h = hash_bytes(tri_mesh.indices.data(), sizeof(uint32_t) * tri_mesh.indices.size(), h);
+    return h;
+}
+
+inline bool must_build_bvh(uint64_t hash)
 {
     std::ifstream bvh_stamp("data/bvh.stamp", std::fstream::in);
-    if (bvh_stamp)
+    std::ifstream bvh_file("data/bvh.bin", std::ios::binary);
+    if (bvh_stamp && bvh_file)
     {
-        int bvh_target;
-        bvh_stamp >> bvh_target;
-        if (bvh_target != (int)target)
-            return true;
-        std::string bvh_name;
-        bvh_stamp >> bvh_name;
-        if (bvh_name != name)
-            return true;
-        return false;
+        uint64_t bvh_hash = 0;
+        bvh_stamp >> std::hex >> bvh_hash;
+        return !bvh_stamp || bvh_hash != hash;
     }
     return true;
-}
\ No newline at end of file
+}
+
+// Removes the stamp, so that an interrupted build is never considered up to date
+inline void invalidate_bvh_stamp()
+{
+    std::remove("data/bvh.stamp");
+}
+
+inline void write_bvh_stamp(uint64_t hash)
+{
+    std::ofstream bvh_stamp("data/bvh.stamp");
+    bvh_stamp << std::hex << hash;
+}
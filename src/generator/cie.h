@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+/// Evaluation method of the CIE matching functions, used by the tone mapper of the path tracer.
+enum class CieMatching : uint32_t
+{
+    TABLE = 0,
+    LUT,
+    FIT
+};
+
+/// Returns the Impala expression that creates the tone mapper for the given method.
+inline const char *cie_tonemapper_constructor(CieMatching cie)
+{
+    switch (cie)
+    {
+    case CieMatching::LUT:
+        return "make_tonemapper_cie_xyz_lut()";
+    case CieMatching::FIT:
+        return "make_tonemapper_cie_xyz_fit(device.intrinsics)";
+    default:
+        return "make_tonemapper_cie_xyz()";
+    }
+}
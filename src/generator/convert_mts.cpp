@@ -28,6 +28,8 @@ struct LoadInfo {
     ::Target Target;
     size_t MaxPathLen;
     size_t SPP;
+    ::Sampler Sampler;
+    CieMatching Cie;
     bool EmbreeBVH;
     bool Fusion;
     bool EnablePadding;
@@ -69,6 +71,7 @@ struct GenContext {
     mesh::TriMesh Mesh;
     BBox SceneBBox;
     float SceneDiameter = 0.0f;
+    bool Instanced = false;     // Whether the scene uses a two-level BVH
 };
 
 inline bool is_simple_brdf(const std::string &brdf)
@@ -86,13 +89,13 @@ inline void setup_integrator(const Object &obj, const LoadInfo& info, std::ostre
 
         lastMPL = child->property("max_depth").getInteger(info.MaxPathLen);
         if (child->pluginType() == "path") {
-            os << "    let renderer = make_path_tracing_renderer(" << lastMPL << " /*max_path_len*/, " << info.SPP << " /*spp*/);\n";
+            os << "    let renderer = make_path_tracing_renderer(" << lastMPL << " /*max_path_len*/, " << info.SPP << " /*spp*/, " << sampler_constructor(info.Sampler) << ", " << cie_tonemapper_constructor(info.Cie) << ");\n";
             return;
         }
     }
 
     warn("No known integrator specified, therefore using path tracer");
-    os << "    let renderer = make_path_tracing_renderer(" << lastMPL << " /*max_path_len*/, " << info.SPP << " /*spp*/);\n";
+    os << "    let renderer = make_path_tracing_renderer(" << lastMPL << " /*max_path_len*/, " << info.SPP << " /*spp*/, " << sampler_constructor(info.Sampler) << ", " << cie_tonemapper_constructor(info.Cie) << ");\n";
     //os << "     let renderer = make_debug_renderer();\n";
 }
 
@@ -233,50 +236,155 @@ inline mesh::TriMesh setup_mesh_serialized(const Object& elem, const LoadInfo& i
     return trimesh;
 }
 
+// Meshes used by at least that many shapes are instanced, instead of being copied for every shape
+static constexpr size_t min_instance_count = 2;
+// Meshes with fewer triangles are always copied, as they are cheaper to intersect in world space
+static constexpr size_t min_instanced_tris = 64;
+
+// Mesh loaded from the scene description, possibly shared by several shapes
+struct MeshSource {
+    mesh::TriMesh Mesh;
+    BBox Bounds;
+    size_t Uses = 0;
+    bool Instanced = false;
+    uint32_t TriOffset = 0;
+};
+
+// Identifies the meshes that are loaded from the same source
+inline std::string shape_mesh_key(const Object& elem) {
+    std::ostringstream key;
+    key << elem.pluginType() << ":"
+        << elem.property("filename").getString() << ":"
+        << elem.property("shape_index").getInteger(0) << ":"
+        << elem.property("flip_normals").getBool();
+    return key.str();
+}
+
+inline mesh::TriMesh setup_shape_mesh(const Object& elem, const LoadInfo& info) {
+    mesh::TriMesh mesh;
+    if (elem.pluginType() == "rectangle") {
+        mesh = setup_mesh_rectangle(elem, info);
+    } else if (elem.pluginType() == "cube") {
+        mesh = setup_mesh_cube(elem, info);
+    } else if(elem.pluginType() == "obj") {
+        mesh = setup_mesh_obj(elem, info);
+    } else if(elem.pluginType() == "ply") {
+        mesh = setup_mesh_ply(elem, info);
+    } else if(elem.pluginType() == "serialized") {
+        mesh = setup_mesh_serialized(elem, info);
+    } else {
+        warn("Can not load shape type '", elem.pluginType(), "'");
+        return mesh;
+    }
+
+    if(!mesh.vertices.empty() && elem.property("flip_normals").getBool())
+        mesh::flip_normals(mesh);
+    return mesh;
+}
+
+// The GPU traversal and the Embree BVHs only have one level
+inline bool supports_instancing(const LoadInfo& info) {
+    return !info.EmbreeBVH &&
+           (info.Target == Target::GENERIC || info.Target == Target::AVX2 || info.Target == Target::AVX ||
+            info.Target == Target::SSE42 || info.Target == Target::ASIMD);
+}
+
+// Computes the inverse of the affine part of a transform
+inline void invertTransformAffine(const Transform& t, float (&inv)[3][4]) {
+    float c[3][3];
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            c[j][i] = t(i1,j1) * t(i2,j2) - t(i1,j2) * t(i2,j1);
+        }
+    }
+    float det = t(0,0) * c[0][0] + t(0,1) * c[1][0] + t(0,2) * c[2][0];
+    if(det == 0.0f)
+        error("Singular shape transformation");
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j)
+            inv[i][j] = c[i][j] / det;
+        inv[i][3] = -(inv[i][0] * t(0,3) + inv[i][1] * t(1,3) + inv[i][2] * t(2,3));
+    }
+}
+
+template <size_t N>
+static void write_instanced_bvh(const mesh::TriMesh& world_mesh, const std::vector<MeshSource>& sources,
+                                std::vector<Instance> instances, const std::vector<size_t>& instance_sources,
+                                const std::vector<BBox>& instance_bboxes) {
+    // Object-level BVH: the part of the scene that is not instanced comes first, followed by every instanced mesh
+    std::vector<typename BvhNTriM<N, 4>::Node> nodes, mesh_nodes;
+    std::vector<Tri4> tris, mesh_tris;
+    // The traversal starts with the part of the scene that is not instanced at node 1: when there is none, that node is empty
+    if(!world_mesh.indices.empty())
+        build_bvh<N, 4>(world_mesh, nodes, tris);
+    else
+        nodes.emplace_back(make_empty_node<typename BvhNTriM<N, 4>::Node, N>());
+
+    std::vector<int32_t> roots(sources.size(), 0);
+    for(size_t i = 0; i < sources.size(); ++i) {
+        if(!sources[i].Instanced)
+            continue;
+        mesh_nodes.clear();
+        mesh_tris.clear();
+        build_bvh<N, 4>(sources[i].Mesh, mesh_nodes, mesh_tris);
+        roots[i] = append_bvh(nodes, tris, mesh_nodes, mesh_tris, sources[i].TriOffset);
+    }
+    write_bvh(nodes, tris);
+
+    for(size_t i = 0; i < instance_sources.size(); ++i)
+        instances[i].root = roots[instance_sources[i]];
+
+    std::vector<typename BvhNTriM<N, 4>::Node> top_nodes;
+    std::vector<Instance> top_instances;
+    build_instance_bvh<N>(instances, instance_bboxes, top_nodes, top_instances);
+    write_bvh(top_nodes, top_instances, "data/instances.bin");
+}
+
 static void setup_shapes(const Object& elem, const LoadInfo& info, GenContext& ctx, std::ostream &os) {
     std::unordered_map<Material, uint32_t, MaterialHash> unique_mats;
 
+    // Load every mesh once, even when several shapes use it
+    std::vector<MeshSource> sources;
+    std::unordered_map<std::string, size_t> source_ids;
+    std::vector<std::pair<std::shared_ptr<Object>, size_t>> shapes;
     for(const auto& child : elem.anonymousChildren()) {
         if(child->type() != OT_SHAPE)
             continue;
 
-        mesh::TriMesh child_mesh;
-        if (child->pluginType() == "rectangle") {
-            child_mesh = setup_mesh_rectangle(*child, info);
-        } else if (child->pluginType() == "cube") {
-            child_mesh = setup_mesh_cube(*child, info);
-        } else if(child->pluginType() == "obj") {
-            child_mesh = setup_mesh_obj(*child, info);
-        } else if(child->pluginType() == "ply") {
-            child_mesh = setup_mesh_ply(*child, info);
-        } else if(child->pluginType() == "serialized") {
-            child_mesh = setup_mesh_serialized(*child, info);
-        } else {
-            warn("Can not load shape type '", child->pluginType(), "'");
-            continue;
+        auto key = shape_mesh_key(*child);
+        auto it = source_ids.find(key);
+        if(it == source_ids.end()) {
+            MeshSource source;
+            source.Mesh = setup_shape_mesh(*child, info);
+            source.Bounds = BBox::empty();
+            for(auto& v : source.Mesh.vertices)
+                source.Bounds.extend(v);
+            it = source_ids.emplace(key, sources.size()).first;
+            sources.emplace_back(std::move(source));
         }
+        sources[it->second].Uses++;
+        shapes.emplace_back(child, it->second);
+    }
 
-        if(child_mesh.vertices.empty())
+    const bool instancing = supports_instancing(info);
+    std::vector<Instance> instances;
+    std::vector<size_t> instance_sources;
+    std::vector<BBox> instance_bboxes;
+    std::vector<float3> normal_matrices;
+    for(const auto& pair : shapes) {
+        const auto& child = pair.first;
+        auto& source = sources[pair.second];
+        if(source.Mesh.vertices.empty())
             continue;
 
-        auto flip = child->property("flip_normals").getBool();
-        if(flip)
-            mesh::flip_normals(child_mesh);
-        
-        auto transform = child->property("to_world").getTransform();
-        for(size_t i = 0; i < child_mesh.vertices.size(); ++i)
-            child_mesh.vertices[i] = applyTransformAffine(transform, child_mesh.vertices[i]);
-        for(size_t i = 0; i < child_mesh.normals.size(); ++i)
-            child_mesh.normals[i] = applyNormalTransform(transform, child_mesh.normals[i]);
-        for(size_t i = 0; i < child_mesh.face_normals.size(); ++i)
-            child_mesh.face_normals[i] = applyNormalTransform(transform, child_mesh.face_normals[i]);
-            
         Shape shape;
         shape.VtxOffset = ctx.Mesh.vertices.size();
         shape.ItxOffset = ctx.Mesh.indices.size();
-        shape.VtxCount  = child_mesh.vertices.size();
-        shape.ItxCount  = child_mesh.indices.size();
-        
+        shape.VtxCount  = source.Mesh.vertices.size();
+        shape.ItxCount  = source.Mesh.indices.size();
+
         // Setup material & light
         for(const auto& inner_child : child->anonymousChildren()) {
             if(inner_child->type() == OT_BSDF)
@@ -301,46 +409,97 @@ static void setup_shapes(const Object& elem, const LoadInfo& info, GenContext& c
             ctx.Materials.emplace_back(shape.Material);
         }
 
+        auto transform = child->property("to_world").getTransform();
+
+        // Emitters are always copied, since lights are sampled in world space
+        if(instancing && !shape.Material.Light &&
+           source.Uses >= min_instance_count && source.Mesh.indices.size() / 4 >= min_instanced_tris) {
+            Instance instance;
+            std::memset(&instance, 0, sizeof(Instance));
+            invertTransformAffine(transform, instance.from_world);
+            instance.geom_id = unique_mats.at(shape.Material);
+            instance.inst_id = instances.size();
+
+            BBox bbox = BBox::empty();
+            for(int i = 0; i < 8; ++i) {
+                float3 corner((i & 1) ? source.Bounds.max.x : source.Bounds.min.x,
+                              (i & 2) ? source.Bounds.max.y : source.Bounds.min.y,
+                              (i & 4) ? source.Bounds.max.z : source.Bounds.min.z);
+                bbox.extend(applyTransformAffine(transform, corner));
+            }
+
+            // The normal matrix is the transpose of the inverse, stored by columns
+            for(int i = 0; i < 3; ++i)
+                normal_matrices.emplace_back(instance.from_world[i][0], instance.from_world[i][1], instance.from_world[i][2]);
+
+            source.Instanced = true;
+            instances.emplace_back(instance);
+            instance_sources.emplace_back(pair.second);
+            instance_bboxes.emplace_back(bbox);
+            continue;
+        }
+
+        mesh::TriMesh child_mesh = source.Mesh;
+        for(size_t i = 0; i < child_mesh.vertices.size(); ++i)
+            child_mesh.vertices[i] = applyTransformAffine(transform, child_mesh.vertices[i]);
+        for(size_t i = 0; i < child_mesh.normals.size(); ++i)
+            child_mesh.normals[i] = applyNormalTransform(transform, child_mesh.normals[i]);
+        for(size_t i = 0; i < child_mesh.face_normals.size(); ++i)
+            child_mesh.face_normals[i] = applyNormalTransform(transform, child_mesh.face_normals[i]);
+
         mesh::replace_material(child_mesh, unique_mats.at(shape.Material));
-        mesh::merge(ctx.Mesh, child_mesh); 
+        mesh::merge(ctx.Mesh, child_mesh);
         ctx.Shapes.emplace_back(std::move(shape));
     }
 
-    if(ctx.Shapes.empty()) {
+    if(ctx.Shapes.empty() && instances.empty()) {
         error("No mesh available");
         return;
     }
 
-    ::info("Generating merged triangle mesh");
-    os << "\n    // Triangle mesh\n"
-       << "    let vertices     = device.load_buffer(\"data/vertices.bin\");\n"
-       << "    let normals      = device.load_buffer(\"data/normals.bin\");\n"
-       << "    let face_normals = device.load_buffer(\"data/face_normals.bin\");\n"
-       << "    let face_area    = device.load_buffer(\"data/face_area.bin\");\n"
-       << "    let texcoords    = device.load_buffer(\"data/texcoords.bin\");\n"
-       << "    let indices      = device.load_buffer(\"data/indices.bin\");\n"
-       << "    let tri_mesh     = TriMesh {\n"
-       << "        vertices:     @ |i| vertices.load_vec3(i),\n"
-       << "        normals:      @ |i| normals.load_vec3(i),\n"
-       << "        face_normals: @ |i| face_normals.load_vec3(i),\n"
-       << "        face_area:    @ |i| face_area.load_f32(i),\n"
-       << "        triangles:    @ |i| { let (i, j, k, _) = indices.load_int4(i); (i, j, k) },\n"
-       << "        attrs:        @ |_| (false, @ |j| vec2_to_4(texcoords.load_vec2(j), 0.0f, 0.0f)),\n"
-       << "        num_attrs:    1,\n"
-       << "        num_tris:     " << ctx.Mesh.indices.size() / 4 << "\n"
-       << "    };\n"
-       << "    let bvh = device.load_bvh(\"data/bvh.bin\");\n";
+    // Calculate scene bounding box
+    ctx.SceneBBox = BBox::empty();
+    for(size_t i = 0; i < ctx.Mesh.vertices.size(); ++i)
+        ctx.SceneBBox.extend(ctx.Mesh.vertices[i]);
+    for(const auto& bbox : instance_bboxes)
+        ctx.SceneBBox.extend(bbox);
+    ctx.SceneDiameter = length(ctx.SceneBBox.max - ctx.SceneBBox.min);
 
-    if(ctx.Mesh.face_area.size() < 4) // Make sure it is not too small
-        ctx.Mesh.face_area.resize(16);
-    write_tri_mesh(ctx.Mesh, info.EnablePadding);
+    // The instanced meshes are stored once, in object space, after the rest of the scene
+    ctx.Instanced = !instances.empty();
+    auto bvh_hash = bvh_stamp_hash(ctx.Mesh, info.Target, info.EmbreeBVH);
+    // The instancing thresholds decide which meshes are flattened into the scene BVH
+    const uint64_t instancing_params[] = { min_instance_count, min_instanced_tris };
+    bvh_hash = hash_bytes(instancing_params, sizeof(instancing_params), bvh_hash);
+    if(ctx.Instanced) {
+        ::info("Instancing ", instances.size(), " shape(s)");
+        uint32_t tri_offset = ctx.Mesh.indices.size() / 4;
+        for(auto& source : sources) {
+            if(!source.Instanced)
+                continue;
+            source.TriOffset = tri_offset;
+            tri_offset += source.Mesh.indices.size() / 4;
+            bvh_hash = hash_bytes(source.Mesh.vertices.data(), sizeof(float3) * source.Mesh.vertices.size(), bvh_hash);
+            bvh_hash = hash_bytes(source.Mesh.indices.data(), sizeof(uint32_t) * source.Mesh.indices.size(), bvh_hash);
+        }
+        bvh_hash = hash_bytes(instances.data(), sizeof(Instance) * instances.size(), bvh_hash);
+    }
 
     // Generate BVHs
-    if (must_build_bvh(info.Filename, info.Target))
+    if (must_build_bvh(bvh_hash))
     {
         ::info("Generating BVH for '", info.Filename, "'");
+        invalidate_bvh_stamp();
         std::remove("data/bvh.bin");
-        if (info.Target == Target::NVVM_STREAMING || info.Target == Target::NVVM_MEGAKERNEL ||
+        std::remove("data/instances.bin");
+        if (ctx.Instanced)
+        {
+            if (info.Target == Target::GENERIC || info.Target == Target::ASIMD || info.Target == Target::SSE42)
+                write_instanced_bvh<4>(ctx.Mesh, sources, instances, instance_sources, instance_bboxes);
+            else
+                write_instanced_bvh<8>(ctx.Mesh, sources, instances, instance_sources, instance_bboxes);
+        }
+        else if (info.Target == Target::NVVM_STREAMING || info.Target == Target::NVVM_MEGAKERNEL ||
             info.Target == Target::AMDGPU_STREAMING || info.Target == Target::AMDGPU_MEGAKERNEL)
         {
             std::vector<typename BvhNTriM<2, 1>::Node> nodes;
@@ -372,19 +531,50 @@ static void setup_shapes(const Object& elem, const LoadInfo& info, GenContext& c
                 build_bvh<8, 4>(ctx.Mesh, nodes, tris);
             write_bvh(nodes, tris);
         }
-        std::ofstream bvh_stamp("data/bvh.stamp");
-        bvh_stamp << int(info.Target) << " " << info.Filename;
+        write_bvh_stamp(bvh_hash);
     }
     else
     {
         ::info("Reusing existing BVH for '", info.Filename, "'");
     }
 
-    // Calculate scene bounding box
-    ctx.SceneBBox = BBox::empty();
-    for(size_t i = 0; i < ctx.Mesh.vertices.size(); ++i)
-        ctx.SceneBBox.extend(ctx.Mesh.vertices[i]);
-    ctx.SceneDiameter = length(ctx.SceneBBox.max - ctx.SceneBBox.min);
+    for(auto& source : sources) {
+        if(!source.Instanced)
+            continue;
+        mesh::replace_material(source.Mesh, 0);
+        mesh::merge(ctx.Mesh, source.Mesh);
+    }
+
+    ::info("Generating merged triangle mesh");
+    os << "\n    // Triangle mesh\n"
+       << "    let vertices     = device.load_buffer(\"data/vertices.bin\");\n"
+       << "    let normals      = device.load_buffer(\"data/normals.bin\");\n"
+       << "    let face_normals = device.load_buffer(\"data/face_normals.bin\");\n"
+       << "    let face_area    = device.load_buffer(\"data/face_area.bin\");\n"
+       << "    let texcoords    = device.load_buffer(\"data/texcoords.bin\");\n"
+       << "    let indices      = device.load_buffer(\"data/indices.bin\");\n"
+       << "    let tri_mesh     = TriMesh {\n"
+       << "        vertices:     @ |i| vertices.load_vec3(i),\n"
+       << "        normals:      @ |i| normals.load_vec3(i),\n"
+       << "        face_normals: @ |i| face_normals.load_vec3(i),\n"
+       << "        face_area:    @ |i| face_area.load_f32(i),\n"
+       << "        triangles:    @ |i| { let (i, j, k, _) = indices.load_int4(i); (i, j, k) },\n"
+       << "        attrs:        @ |_| (false, @ |j| vec2_to_4(texcoords.load_vec2(j), 0.0f, 0.0f)),\n"
+       << "        num_attrs:    1,\n"
+       << "        num_tris:     " << ctx.Mesh.indices.size() / 4 << "\n"
+       << "    };\n";
+    if(ctx.Instanced) {
+        os << "    let bvh = device.load_instanced_bvh(\"data/bvh.bin\", \"data/instances.bin\");\n"
+           << "    let normal_matrices = device.load_buffer(\"data/normal_matrices.bin\");\n"
+           << "    let normal_matrix = @ |i: i32| make_mat3x3(normal_matrices.load_vec3(i * 3 + 0), normal_matrices.load_vec3(i * 3 + 1), normal_matrices.load_vec3(i * 3 + 2));\n";
+        write_buffer("data/normal_matrices.bin", normal_matrices);
+    } else {
+        os << "    let bvh = device.load_bvh(\"data/bvh.bin\");\n";
+    }
+
+    if(ctx.Mesh.face_area.size() < 4) // Make sure it is not too small
+        ctx.Mesh.face_area.resize(16);
+    write_tri_mesh(ctx.Mesh, info.EnablePadding);
 }
 
 static void load_texture(const std::string& filename, const LoadInfo& info, const GenContext& ctx, std::ostream &os) { 
@@ -642,7 +832,7 @@ static void setup_materials(const Object& elem, const LoadInfo& info, const GenC
         }
 
         if (mat.Light)
-            os << "        make_emissive_material(surf, bsdf, light_" << light_counter << ")\n";
+            os << "        make_emissive_material(surf, bsdf, " << light_counter << ", light_" << light_counter << ")\n";
         else
             os << "        make_material(bsdf)\n";
         os << "    };\n";
@@ -695,9 +885,14 @@ static size_t setup_lights(const Object& elem, const LoadInfo& info, const GenCo
         } else if(child->pluginType() == "envmap") { 
             auto filename = child->property("filename").getString();
             load_texture(filename, info, ctx, os);// TODO: What if filename is used already in the previous material stages
+            const std::string dist_file = "data/envmap_" + std::to_string(light_count) + ".bin";
+            size_t dist_width, dist_height;
+            export_envmap_distribution(info.Dir + "/" + fix_file(filename), dist_file, dist_width, dist_height);
             os << "    let light_" << light_count << " = make_environment_light_textured(math, "
                     << escape_f32(ctx.SceneDiameter) << ", "
-                    << "tex_" << make_id(fix_file(filename)) << ");\n";
+                    << "tex_" << make_id(fix_file(filename)) << ", "
+                    << "device.load_buffer(\"" << dist_file << "\"), "
+                    << dist_width << ", " << dist_height << ");\n";
         } else {
             warn("Unknown emitter type '", child->pluginType(), "'");
             continue;
@@ -720,6 +915,7 @@ static size_t setup_lights(const Object& elem, const LoadInfo& info, const GenCo
         }
         os << "    };\n";
     }
+    os << "    let light_selector = make_uniform_light_selector(" << std::max(light_count, size_t(1)) << ");\n";
 
     return light_count;
 }
@@ -743,7 +939,10 @@ static void convert_scene(const Scene &scene, const LoadInfo& info, std::ostream
             os << s;
         else
             os << "_";
-        os << " => make_tri_mesh_geometry(math, tri_mesh, material_" << s << "),\n";
+        if (ctx.Instanced)
+            os << " => make_instanced_tri_mesh_geometry(math, tri_mesh, normal_matrix, material_" << s << "),\n";
+        else
+            os << " => make_tri_mesh_geometry(math, tri_mesh, material_" << s << "),\n";
     }
     os << "    };\n";
 
@@ -753,13 +952,14 @@ static void convert_scene(const Scene &scene, const LoadInfo& info, std::ostream
        << "        num_lights:     " << light_count << ",\n"
        << "        geometries:     @ |i| geometries(i),\n"
        << "        lights:         @ |i| lights(i),\n"
+       << "        light_selector: light_selector,\n"
        << "        camera:         camera,\n"
        << "        bvh:            bvh\n"
        << "    };\n";
 }
 
 bool convert_mts(const std::string &file_name, Target target,
-                 size_t dev, size_t max_path_len, size_t spp, bool embree_bvh, bool fusion,
+                 size_t dev, size_t max_path_len, size_t spp, Sampler sampler, CieMatching cie, bool embree_bvh, bool fusion,
                  SpectralUpsampler *upsampler, std::ostream &os)
 {
     info("Converting MTS file '", file_name, "'");
@@ -785,7 +985,9 @@ bool convert_mts(const std::string &file_name, Target target,
            << "    up: Vec3,\n"
            << "    right: Vec3,\n"
            << "    width: f32,\n"
-           << "    height: f32\n"
+           << "    height: f32,\n"
+           << "    num_threads: i32,\n"
+           << "    tile_size: i32\n"
            << "};\n";
 
         os << "\nextern fn get_spp() -> i32 { " << spp << " }\n";
@@ -798,6 +1000,8 @@ bool convert_mts(const std::string &file_name, Target target,
         info.Target        = target;
         info.MaxPathLen    = max_path_len;
         info.SPP           = spp;
+        info.Sampler       = sampler;
+        info.Cie           = cie;
         info.EmbreeBVH     = embree_bvh;
         info.Fusion        = fusion;
         info.EnablePadding = target == Target::NVVM_STREAMING ||
@@ -809,22 +1013,22 @@ bool convert_mts(const std::string &file_name, Target target,
         switch (target)
         {
         case Target::GENERIC:
-            os << "    let device   = make_cpu_default_device();\n";
+            os << "    let device   = make_cpu_default_device(settings.num_threads, settings.tile_size);\n";
             break;
         case Target::AVX2:
-            os << "    let device   = make_avx2_device(false);\n";
+            os << "    let device   = make_avx2_device(false, settings.num_threads, settings.tile_size);\n";
             break;
         case Target::AVX2_EMBREE:
-            os << "    let device   = make_avx2_device(true);\n";
+            os << "    let device   = make_avx2_device(true, settings.num_threads, settings.tile_size);\n";
             break;
         case Target::AVX:
-            os << "    let device   = make_avx_device();\n";
+            os << "    let device   = make_avx_device(settings.num_threads, settings.tile_size);\n";
             break;
         case Target::SSE42:
-            os << "    let device   = make_sse42_device();\n";
+            os << "    let device   = make_sse42_device(settings.num_threads, settings.tile_size);\n";
             break;
         case Target::ASIMD:
-            os << "    let device   = make_asimd_device();\n";
+            os << "    let device   = make_asimd_device(settings.num_threads, settings.tile_size);\n";
             break;
         case Target::NVVM_STREAMING:
             os << "    let device   = make_nvvm_device(" << dev << ", true);\n";
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "target.h"
+#include "sampler.h"
+#include "cie.h"
 #include <string>
 
 class SpectralUpsampler;
 bool convert_mts(const std::string &file_name, Target target,
-                size_t dev, size_t max_path_len, size_t spp, bool embree_bvh, bool fusion, 
+                size_t dev, size_t max_path_len, size_t spp, Sampler sampler, CieMatching cie, bool embree_bvh, bool fusion, 
                 SpectralUpsampler* upsampler, std::ostream &os);
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "export_image.h"
 #include "spectral.h"
 #include "platform.h"
+#include "runtime/distribution.h"
 
 static bool operator==(const obj::Material &a, const obj::Material &b)
 {
@@ -151,7 +152,7 @@ static size_t cleanup_obj(SpectralUpsampler* upsampler, obj::File &obj_file, obj
 }
 
 bool convert_obj(const std::string &file_name, Target target,
-                size_t dev, size_t max_path_len, size_t spp, bool embree_bvh, bool fusion,
+                size_t dev, size_t max_path_len, size_t spp, Sampler sampler, CieMatching cie, bool embree_bvh, bool fusion,
                 SpectralUpsampler* upsampler, std::ostream &os)
 {
     info("Converting OBJ file '", file_name, "'");
@@ -209,7 +210,9 @@ bool convert_obj(const std::string &file_name, Target target,
        << "    up: Vec3,\n"
        << "    right: Vec3,\n"
        << "    width: f32,\n"
-       << "    height: f32\n"
+       << "    height: f32,\n"
+       << "    num_threads: i32,\n"
+       << "    tile_size: i32\n"
        << "};\n";
 
     os << "\nextern fn get_spp() -> i32 { " << spp << " }\n";
@@ -223,22 +226,22 @@ bool convert_obj(const std::string &file_name, Target target,
     switch (target)
     {
     case Target::GENERIC:
-        os << "    let device   = make_cpu_default_device();\n";
+        os << "    let device   = make_cpu_default_device(settings.num_threads, settings.tile_size);\n";
         break;
     case Target::AVX2:
-        os << "    let device   = make_avx2_device(false);\n";
+        os << "    let device   = make_avx2_device(false, settings.num_threads, settings.tile_size);\n";
         break;
     case Target::AVX2_EMBREE:
-        os << "    let device   = make_avx2_device(true);\n";
+        os << "    let device   = make_avx2_device(true, settings.num_threads, settings.tile_size);\n";
         break;
     case Target::AVX:
-        os << "    let device   = make_avx_device();\n";
+        os << "    let device   = make_avx_device(settings.num_threads, settings.tile_size);\n";
         break;
     case Target::SSE42:
-        os << "    let device   = make_sse42_device();\n";
+        os << "    let device   = make_sse42_device(settings.num_threads, settings.tile_size);\n";
         break;
     case Target::ASIMD:
-        os << "    let device   = make_asimd_device();\n";
+        os << "    let device   = make_asimd_device(settings.num_threads, settings.tile_size);\n";
         break;
     case Target::NVVM_STREAMING:
         os << "    let device   = make_nvvm_device(" << dev << ", true);\n";
@@ -257,7 +260,7 @@ bool convert_obj(const std::string &file_name, Target target,
         break;
     }
 
-    os << "    let renderer = make_path_tracing_renderer(" << max_path_len << " /*max_path_len*/, " << spp << " /*spp*/);\n"
+    os << "    let renderer = make_path_tracing_renderer(" << max_path_len << " /*max_path_len*/, " << spp << " /*spp*/, " << sampler_constructor(sampler) << ", " << cie_tonemapper_constructor(cie) << ");\n"
        //<< "    let renderer = make_whitefurnance_renderer();\n"
        << "    let math     = device.intrinsics;\n";
 
@@ -329,9 +332,11 @@ bool convert_obj(const std::string &file_name, Target target,
     write_tri_mesh(tri_mesh, enable_padding);
 
     // Generate BVHs
-    if (must_build_bvh(file_name, target))
+    auto bvh_hash = bvh_stamp_hash(tri_mesh, target, embree_bvh);
+    if (must_build_bvh(bvh_hash))
     {
         info("Generating BVH for '", file_name, "'");
+        invalidate_bvh_stamp();
         std::remove("data/bvh.bin");
         if (target == Target::NVVM_STREAMING || target == Target::NVVM_MEGAKERNEL ||
             target == Target::AMDGPU_STREAMING || target == Target::AMDGPU_MEGAKERNEL)
@@ -365,8 +370,7 @@ bool convert_obj(const std::string &file_name, Target target,
                 build_bvh<8, 4>(tri_mesh, nodes, tris);
             write_bvh(nodes, tris);
         }
-        std::ofstream bvh_stamp("data/bvh.stamp");
-        bvh_stamp << int(target) << " " << file_name;
+        write_bvh_stamp(bvh_hash);
     }
     else
     {
@@ -391,6 +395,8 @@ bool convert_obj(const std::string &file_name, Target target,
     std::vector<float3> light_norms;
     std::vector<float> light_areas;
     std::vector<float> light_powers;
+    std::vector<float> light_weights;
+    std::vector<uint32_t> light_tris;
     for (size_t i = 0; i < tri_mesh.indices.size(); i += 4)
     {
         // Do not leave this array undefined, even if this triangle is not a light
@@ -412,6 +418,7 @@ bool convert_obj(const std::string &file_name, Target target,
         auto &v2 = tri_mesh.vertices[tri_mesh.indices[i + 2]];
 
         light_ids[i / 4] = num_lights++;
+        light_tris.push_back(i / 4);
         if (has_map_ke)
         {
             os << "    let light" << num_lights - 1 << " = make_triangle_light(\n"
@@ -441,6 +448,8 @@ bool convert_obj(const std::string &file_name, Target target,
             light_areas.emplace_back(inv_area);
             light_colors.emplace_back(kec);
             light_powers.emplace_back(kec_power);
+            // Lights are picked proportionally to their power
+            light_weights.emplace_back(luminance(mat.ke) / inv_area);
         }
     }
     if (has_map_ke || num_lights == 0)
@@ -461,6 +470,7 @@ bool convert_obj(const std::string &file_name, Target target,
         {
             os << "    let lights = @ |_| make_point_light(math, make_vec3(0.0f, 0.0f, 0.0f), make_spectrum_none());\n";
         }
+        os << "    let light_selector = make_uniform_light_selector(" << std::max(num_lights, size_t(1)) << ");\n";
     }
     else
     {
@@ -469,6 +479,7 @@ bool convert_obj(const std::string &file_name, Target target,
         write_buffer("data/light_norms.bin", pad_buffer(light_norms, enable_padding, sizeof(float) * 4));
         write_buffer("data/light_colors.bin", pad_buffer(light_colors, enable_padding, sizeof(float) * 4));
         write_buffer("data/light_powers.bin", light_powers);
+        write_buffer("data/light_select.bin", build_alias_table(light_weights));
 
         os << "    let light_verts = device.load_buffer(\"data/light_verts.bin\");\n"
            << "    let light_areas = device.load_buffer(\"data/light_areas.bin\");\n"
@@ -485,10 +496,13 @@ bool convert_obj(const std::string &file_name, Target target,
            << "            light_areas.load_f32(i),\n"
            << "            make_colored_d65_illum(light_powers.load_f32(i), make_coeff_spectrum_v(math, light_colors.load_vec3(i)))\n"
            << "        )\n"
-           << "    };\n";
+           << "    };\n"
+           << "    let light_selector = make_alias_light_selector(" << num_lights << ", device.load_buffer(\"data/light_select.bin\"));\n";
     }
 
     write_buffer("data/light_ids.bin", light_ids);
+    // Triangle of each light, used by the driver to update the lights when the vertices move
+    write_buffer("data/light_tris.bin", light_tris);
 
     os << "\n    // Mapping from primitive to light source\n"
        << "    let light_ids = device.load_buffer(\"data/light_ids.bin\");\n";
@@ -579,7 +593,8 @@ bool convert_obj(const std::string &file_name, Target target,
         }
         if (has_emission)
         {
-            os << "        make_emissive_material(surf, bsdf, lights(light_ids.load_i32(hit.prim_id)))\n";
+            os << "        let light_id = light_ids.load_i32(hit.prim_id);\n"
+               << "        make_emissive_material(surf, bsdf, light_id, lights(light_id))\n";
         }
         else
         {
@@ -630,6 +645,7 @@ bool convert_obj(const std::string &file_name, Target target,
        << "        num_lights:     " << num_lights << ",\n"
        << "        geometries:     @ |i| geometries(i),\n"
        << "        lights:         @ |i| lights(i),\n"
+       << "        light_selector: light_selector,\n"
        << "        camera:         camera,\n"
        << "        bvh:            bvh\n"
        << "    };\n";
@@ -1,30 +1,138 @@
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
 #include "export_image.h"
 #include "runtime/image.h"
 #include "runtime/common.h"
+#include "runtime/mapped_file.h"
+#include "runtime/buffer.h"
+#include "runtime/color.h"
+#include "runtime/distribution.h"
 #include "spectral.h"
+#include "platform.h"
+#include "hash.h"
 
-FilePath export_image(SpectralUpsampler *upsampler, const FilePath &path)
+#include <tbb/parallel_for.h>
+
+// Converted textures are stored along with a stamp, holding the modification time, size and hash of the source image,
+// as well as the hash of the upsampler coefficients. When the modification time or size differ, the source is hashed
+// again, so that touching a file does not trigger a conversion.
+struct TextureStamp
 {
-    ImageRgba32 data;
-    const auto ext = path.extension();
+    int64_t mtime = -1;
+    int64_t size = -1;
+    uint64_t hash = 0;
+    uint64_t coeffs = 0;
+};
+
+static bool read_stamp(const std::string &file_name, TextureStamp &stamp)
+{
+    std::ifstream is(file_name);
+    is >> stamp.mtime >> stamp.size >> std::hex >> stamp.hash >> stamp.coeffs;
+    return bool(is);
+}
 
+static void write_stamp(const std::string &file_name, const TextureStamp &stamp)
+{
+    std::ofstream os(file_name);
+    os << stamp.mtime << " " << stamp.size << " " << std::hex << stamp.hash << " " << stamp.coeffs;
+}
+
+static uint64_t hash_file(const std::string &file_name)
+{
+    MappedFile file(file_name);
+    return file.is_open() ? hash_bytes(file.data(), file.size()) : 0;
+}
+
+static bool load_image(const FilePath &path, ImageRgba32 &data)
+{
+    const auto ext = path.extension();
     if (ext == "png")
-        load_png(path, data);
+        return load_png(path, data);
     else if (ext == "jpg" || ext == "jpeg")
-        load_jpg(path, data);
+        return load_jpg(path, data);
     else if (ext == "exr")
-        load_exr(path, data);
-    else
+        return load_exr(path, data);
+    error("Unknown file type '", path.path(), "'");
+}
+
+FilePath export_image(SpectralUpsampler *upsampler, const FilePath &path)
+{
+    std::string new_path = "data/textures/" + path.remove_extension() + ".exr";
+    std::string stamp_path = new_path + ".stamp";
+
+    TextureStamp stamp, old_stamp;
+    stamp.coeffs = upsampler->hash();
+    bool has_status = file_status(path.path().c_str(), stamp.mtime, stamp.size);
+    int64_t out_mtime, out_size;
+    if (has_status &&
+        read_stamp(stamp_path, old_stamp) &&
+        old_stamp.coeffs == stamp.coeffs &&
+        file_status(new_path.c_str(), out_mtime, out_size))
     {
-        error("Unknown file type '", path.path(), "'");
-        return FilePath("");
+        if (stamp.mtime == old_stamp.mtime && stamp.size == old_stamp.size)
+            return new_path;
+        stamp.hash = hash_file(path);
+        if (stamp.hash == old_stamp.hash)
+        {
+            write_stamp(stamp_path, stamp);
+            return new_path;
+        }
     }
 
-    upsampler->prepare(&data.pixels[0], 4, &data.pixels[1], 4, &data.pixels[2], 4,
-                       &data.pixels[0], 4, &data.pixels[1], 4, &data.pixels[2], 4,
-                       data.width * data.height);
+    ImageRgba32 data;
+    load_image(path, data);
+
+    upsampler->prepare_image(data.pixels.get(), 4, data.width * data.height);
 
-    std::string new_path = "data/textures/" + path.remove_extension() + ".exr";
-    save_exr(FilePath(new_path), data);
+    // Remove the stamp first, so that an interrupted conversion is never considered up to date
+    std::remove(stamp_path.c_str());
+    if (save_exr(FilePath(new_path), data) && has_status)
+    {
+        if (!stamp.hash)
+            stamp.hash = hash_file(path);
+        write_stamp(stamp_path, stamp);
+    }
     return new_path;
-}
\ No newline at end of file
+}
+
+void export_envmap_distribution(const FilePath &path, const std::string &out_file, size_t &width, size_t &height)
+{
+    ImageRgba32 img;
+    if (!load_image(path, img) || img.width == 0 || img.height == 0)
+    {
+        warn("Cannot load environment map '", path.path(), "', falling back to uniform sampling");
+        width = height = 1;
+        write_buffer(out_file, build_alias_table(std::vector<float>(1, 1.0f)));
+        return;
+    }
+
+    // Cells are averages over blocks of pixels, so that large maps do not produce huge tables
+    width = std::min<size_t>(img.width, 1024);
+    height = std::min<size_t>(img.height, 512);
+    const float pi = 3.14159265358979323846f;
+
+    std::vector<float> weights(width * height);
+    tbb::parallel_for(size_t(0), height, [&](size_t cy) {
+        const size_t y0 = cy * img.height / height, y1 = (cy + 1) * img.height / height;
+        const float sin_theta = std::sin((cy + 0.5f) * pi / height);
+        for (size_t cx = 0; cx < width; ++cx)
+        {
+            const size_t x0 = cx * img.width / width, x1 = (cx + 1) * img.width / width;
+            float sum = 0.0f;
+            for (size_t y = y0; y < y1; ++y)
+            {
+                for (size_t x = x0; x < x1; ++x)
+                {
+                    const float *p = &img.pixels[4 * (y * img.width + x)];
+                    sum += std::max(0.0f, luminance(rgb(p[0], p[1], p[2])));
+                }
+            }
+            weights[cy * width + cx] = sum / ((x1 - x0) * (y1 - y0)) * sin_theta;
+        }
+    });
+
+    write_buffer(out_file, build_alias_table(weights));
+}
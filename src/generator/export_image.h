@@ -1,8 +1,15 @@
 #pragma once
 
+#include <string>
+
 #include "runtime/file_path.h"
 
 class SpectralUpsampler;
 
 /// Exports image while upsampling rgb data and returns path to the new generated file
-FilePath export_image(SpectralUpsampler* upsampler, const FilePath& path);
\ No newline at end of file
+FilePath export_image(SpectralUpsampler* upsampler, const FilePath& path);
+
+/// Exports the distribution used to importance sample an environment map, as an alias table over a grid of
+/// width x height cells (at most 1024x512) in latitude-longitude parameterization. Each cell is weighted by its
+/// average luminance times sin(theta). Falls back to a single cell (uniform sampling) if the image cannot be loaded.
+void export_envmap_distribution(const FilePath& path, const std::string& out_file, size_t& width, size_t& height);
@@ -12,6 +12,7 @@
 
 #include "runtime/common.h"
 #include "runtime/file_path.h"
+#include "runtime/buffer.h"
 
 inline Target cpuid()
 {
@@ -51,7 +52,10 @@ static void usage()
               << "    -d     --device              Sets the device to use on the selected platform (default: 0)\n"
               << "           --max-path-len        Sets the maximum path length (default: 64)\n"
               << "    -spp   --samples-per-pixel   Sets the number of samples per pixel (default: 4)\n"
+              << "           --sampler             Sets the sampler used by the path tracer: random, sobol, bluenoise (default: random)\n"
+              << "           --cie                 Sets how the CIE matching functions are evaluated: table, lut, fit (default: table)\n"
               << "           --fusion              Enables megakernel shader fusion (default: disabled)\n"
+              << "           --uncompressed        Stores scene buffers uncompressed, so that they can be memory-mapped (default: disabled)\n"
 #ifdef ENABLE_EMBREE_BVH
               << "           --embree-bvh          Use Embree to build the BVH (default: disabled)\n"
 #endif
@@ -84,6 +88,8 @@ int main(int argc, char **argv)
     size_t dev = 0;
     size_t spp = 4;
     size_t max_path_len = 64;
+    auto sampler = Sampler::RANDOM;
+    auto cie = CieMatching::TABLE;
     auto target = Target::INVALID;
     bool embree_bvh = false;
     bool fusion = false;
@@ -144,9 +150,45 @@ int main(int argc, char **argv)
                     return 1;
                 max_path_len = strtol(argv[i], NULL, 10);
             }
+            else if (!strcmp(argv[i], "--sampler"))
+            {
+                if (!check_option(i++, argc, argv))
+                    return 1;
+                if (!strcmp(argv[i], "random"))
+                    sampler = Sampler::RANDOM;
+                else if (!strcmp(argv[i], "sobol"))
+                    sampler = Sampler::SOBOL;
+                else if (!strcmp(argv[i], "bluenoise"))
+                    sampler = Sampler::BLUE_NOISE;
+                else
+                {
+                    std::cerr << "Unknown sampler '" << argv[i] << "'. Aborting." << std::endl;
+                    return 1;
+                }
+            }
+            else if (!strcmp(argv[i], "--cie"))
+            {
+                if (!check_option(i++, argc, argv))
+                    return 1;
+                if (!strcmp(argv[i], "table"))
+                    cie = CieMatching::TABLE;
+                else if (!strcmp(argv[i], "lut"))
+                    cie = CieMatching::LUT;
+                else if (!strcmp(argv[i], "fit"))
+                    cie = CieMatching::FIT;
+                else
+                {
+                    std::cerr << "Unknown CIE matching function evaluation '" << argv[i] << "'. Aborting." << std::endl;
+                    return 1;
+                }
+            }
             else if (!strcmp(argv[i], "--fusion"))
             {
                 fusion = true;
+            }
+            else if (!strcmp(argv[i], "--uncompressed"))
+            {
+                set_buffer_compression(false);
 #ifdef ENABLE_EMBREE_BVH
             }
             else if (!strcmp(argv[i], "--embree-bvh"))
@@ -196,17 +238,21 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    std::ofstream of("main.impala");
+    // The code is only written if it changed, to avoid recompiling it needlessly
+    FileUpdateBuf main_file("main.impala");
+    std::ostream of(&main_file);
     FilePath input_path(input_file);
     if(input_path.extension() == "obj") {
-        if (!convert_obj(input_file, target, dev, max_path_len, spp, embree_bvh, fusion, upsampler.get(), of))
+        if (!convert_obj(input_file, target, dev, max_path_len, spp, sampler, cie, embree_bvh, fusion, upsampler.get(), of))
             return 1;
     } else if(input_path.extension() == "xml") {
-        if (!convert_mts(input_file, target, dev, max_path_len, spp, embree_bvh, fusion, upsampler.get(), of))
+        if (!convert_mts(input_file, target, dev, max_path_len, spp, sampler, cie, embree_bvh, fusion, upsampler.get(), of))
             return 1;
     } else {
         error("Unknown input file");
         return 1;
     }
+    if (!main_file.commit())
+        info("Generated code is unchanged, main.impala left untouched");
     return 0;
 }
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// FNV-1a hash, processing 64-bit words at a time
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ull)
+{
+    const uint64_t prime = 0x100000001b3ull;
+    auto bytes = (const uint8_t *)data;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(uint64_t));
+        h = (h ^ word) * prime;
+    }
+    for (; i < size; ++i)
+        h = (h ^ bytes[i]) * prime;
+    return h;
+}
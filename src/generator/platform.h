@@ -1,13 +1,27 @@
 #pragma once
 
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #ifdef WIN32
 #include <direct.h>
 #define create_directory(d) _mkdir(d)
 #else
-#include <sys/stat.h>
 #define create_directory(d) \
     {                       \
         umask(0);           \
         mkdir(d, 0777);     \
     }
-#endif
\ No newline at end of file
+#endif
+
+/// Gets the modification time (in seconds) and size of a file. Returns false if the file does not exist.
+inline bool file_status(const char *path, int64_t &mtime, int64_t &size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    mtime = st.st_mtime;
+    size = st.st_size;
+    return true;
+}
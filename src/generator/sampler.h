@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+enum class Sampler : uint32_t
+{
+    RANDOM = 0,
+    SOBOL,
+    BLUE_NOISE
+};
+
+/// Returns the Impala expression that creates the given sampler.
+inline const char *sampler_constructor(Sampler sampler)
+{
+    switch (sampler)
+    {
+    case Sampler::SOBOL:
+        return "make_sobol_sampler()";
+    case Sampler::BLUE_NOISE:
+        return "make_blue_noise_sampler()";
+    default:
+        return "make_random_sampler()";
+    }
+}
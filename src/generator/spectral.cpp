@@ -2,6 +2,12 @@
 #include <fstream>
 #include <cstring>
 #include <limits>
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "hash.h"
 
 // Base on Wenzel Jakob and Johannes Hanika. 2019. A Low-Dimensional Function Space for Efficient Spectral Upsampling.
 // In Computer Graphics Forum (Proceedings of Eurographics) 38(2).
@@ -12,6 +18,7 @@ struct _SpectralUpsamplerInternal
     uint32_t Resolution;
     float *Scale;
     float *Data;
+    uint64_t Hash;
 };
 
 SpectralUpsampler::SpectralUpsampler(const char *filename)
@@ -42,6 +49,9 @@ SpectralUpsampler::SpectralUpsampler(const char *filename)
 
     mInternal->Data = new float[size_data];
     stream.read(reinterpret_cast<char *>(mInternal->Data), size_data * sizeof(float));
+
+    mInternal->Hash = hash_bytes(mInternal->Scale, size_scale * sizeof(float));
+    mInternal->Hash = hash_bytes(mInternal->Data, size_data * sizeof(float), mInternal->Hash);
 }
 
 SpectralUpsampler::~SpectralUpsampler()
@@ -52,37 +62,46 @@ SpectralUpsampler::~SpectralUpsampler()
         delete[] mInternal->Data;
 }
 
-static int find_interval(const float *values, int size_, float x)
+// Number of elements processed together, so that the compiler can vectorize the lookups
+constexpr size_t BLOCK_SIZE = 16;
+
+void SpectralUpsampler::prepare(const float *r, const float *g, const float *b, float *out_a, float *out_b, float *out_c, size_t elems) const
 {
-    int left = 0;
-    int last_interval = size_ - 2;
-    int size = last_interval;
+    prepare(r,1,g,1,b,1,out_a,1,out_b,1,out_c,1,elems);
+}
 
-    while (size > 0)
+void SpectralUpsampler::prepare(const float* r, size_t r_slice, const float* g, size_t g_slice, const float* b, size_t b_slice,
+	float* out_a, size_t oa_slice, float* out_b, size_t ob_slice, float* out_c, size_t oc_slice, 
+	size_t elems) const {
+    for (size_t i = 0; i < elems; i += BLOCK_SIZE)
     {
-        int half = size >> 1;
-        int middle = left + half + 1;
-
-        if (values[middle] < x)
-        {
-            left = middle;
-            size -= half + 1;
-        }
-        else
-        {
-            size = half;
-        }
+        const size_t n = std::min(BLOCK_SIZE, elems - i);
+        prepare_block(r + i * r_slice, r_slice, g + i * g_slice, g_slice, b + i * b_slice, b_slice,
+                      out_a + i * oa_slice, oa_slice, out_b + i * ob_slice, ob_slice, out_c + i * oc_slice, oc_slice,
+                      n);
     }
+}
 
-    return std::min(left, last_interval);
+void SpectralUpsampler::prepare_image(float *pixels, size_t channels, size_t elems) const
+{
+    // Every task handles a contiguous range of pixels, which is converted in place
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, elems, 4096), [&] (const tbb::blocked_range<size_t>& range) {
+        float *ptr = pixels + range.begin() * channels;
+        prepare(ptr + 0, channels, ptr + 1, channels, ptr + 2, channels,
+                ptr + 0, channels, ptr + 1, channels, ptr + 2, channels,
+                range.size());
+    });
 }
 
-void SpectralUpsampler::prepare(const float *r, const float *g, const float *b, float *out_a, float *out_b, float *out_c, size_t elems) const
+uint64_t SpectralUpsampler::hash() const
 {
-    prepare(r,1,g,1,b,1,out_a,1,out_b,1,out_c,1,elems);
+    return mInternal->Hash;
 }
-    
-void SpectralUpsampler::prepare(const float* r, size_t r_slice, const float* g, size_t g_slice, const float* b, size_t b_slice,
+
+// Processes at most BLOCK_SIZE elements. Every step is a loop over the elements of the block without
+// any branch, so that it is turned into vector instructions (with gathers for the table lookups).
+// The inputs are loaded before any output is written, so the conversion can be done in place.
+void SpectralUpsampler::prepare_block(const float* r, size_t r_slice, const float* g, size_t g_slice, const float* b, size_t b_slice,
 	float* out_a, size_t oa_slice, float* out_b, size_t ob_slice, float* out_c, size_t oc_slice, 
 	size_t elems) const {                
     // TODO: This is not IEC 60559 compliant due to INF*0 -> NaN
@@ -91,71 +110,87 @@ void SpectralUpsampler::prepare(const float* r, size_t r_slice, const float* g,
     constexpr float ZERO_B = 0;
     constexpr float ZERO_C = -50.0f/*std::numeric_limits<float>::infinity()*/; // -500 is also possible and is closer to zero, but -50 is sufficient for floats
 
-    constexpr float ONE_A = 0;
-    constexpr float ONE_B = 0;
-    constexpr float ONE_C = 50000.0f/*std::numeric_limits<float>::infinity()*/;
-
-    const auto res = mInternal->Resolution;
-    const auto dx = COEFFS_N;
-    const auto dy = COEFFS_N * res;
-    const auto dz = COEFFS_N * res * res;
+    const uint32_t res = mInternal->Resolution;
+    const uint32_t dx = COEFFS_N;
+    const uint32_t dy = COEFFS_N * res;
+    const uint32_t dz = COEFFS_N * res * res;
 
     const float *a_scale = mInternal->Scale;
     const float *a_data = mInternal->Data;
 
-    float coeffs[COEFFS_N];
+    float in_r[BLOCK_SIZE] = {}, in_g[BLOCK_SIZE] = {}, in_b[BLOCK_SIZE] = {};
     for (size_t i = 0; i < elems; ++i)
     {
-        const float rgb[3] = {r[i*r_slice], g[i*g_slice], b[i*b_slice]};
+        in_r[i] = r[i * r_slice];
+        in_g[i] = g[i * g_slice];
+        in_b[i] = b[i * b_slice];
+    }
 
+    // Determine largest entry, and rescale
+    float x[BLOCK_SIZE], y[BLOCK_SIZE], z[BLOCK_SIZE];
+    uint32_t largest[BLOCK_SIZE];
+    bool zero[BLOCK_SIZE];
+    for (size_t i = 0; i < BLOCK_SIZE; ++i)
+    {
         // Handle special case when rgb is zero
-        if (rgb[0] <= EPS && rgb[1] <= EPS && rgb[2] <= EPS) {
-            out_a[i] = ZERO_A;
-            out_b[i] = ZERO_B;
-            out_c[i] = ZERO_C;
-            continue;
-        } /*else if(1-rgb[0] <= EPS && 1-rgb[1] <= EPS && 1-rgb[2] <= EPS) {
-            out_a[i] = ONE_A;
-            out_b[i] = ONE_B;
-            out_c[i] = ONE_C;
-            continue;
-        }*/
-
-        // Determine largest entry
-        int largest_entry = 0;
-        if (rgb[largest_entry] <= rgb[1])
-            largest_entry = 1;
-        if (rgb[largest_entry] <= rgb[2])
-            largest_entry = 2;
-
-        // Rescale
-        float z = rgb[largest_entry];
-        float scale = (res - 1) / z;
-        float x = rgb[(largest_entry + 1) % 3] * scale;
-        float y = rgb[(largest_entry + 2) % 3] * scale;
-
-        // Bilinearly interpolate
-        uint32_t xi = std::min((uint32_t)x, res - 2);
-        uint32_t yi = std::min((uint32_t)y, res - 2);
-        uint32_t zi = find_interval(a_scale, res, z);
-        uint32_t off = (((largest_entry * res + zi) * res + yi) * res + xi) * COEFFS_N;
-
-        float x1 = x - xi;
-        float x0 = 1.0f - x1;
-        float y1 = y - yi;
-        float y0 = 1.0f - y1;
-        float z1 = (z - a_scale[zi]) / (a_scale[zi + 1] - a_scale[zi]);
-        float z0 = 1.0f - z1;
-
-        // Lookup
-        for (int j = 0; j < COEFFS_N; ++j)
+        zero[i] = in_r[i] <= EPS && in_g[i] <= EPS && in_b[i] <= EPS;
+
+        const bool g_largest = in_r[i] <= in_g[i];
+        const float rg = g_largest ? in_g[i] : in_r[i];
+        const bool b_largest = rg <= in_b[i];
+        largest[i] = b_largest ? 2 : (g_largest ? 1 : 0);
+        z[i] = b_largest ? in_b[i] : rg;
+
+        // Components that follow the largest one, in cyclic order
+        const float next1 = b_largest ? in_r[i] : (g_largest ? in_b[i] : in_g[i]);
+        const float next2 = b_largest ? in_g[i] : (g_largest ? in_r[i] : in_b[i]);
+        const float scale = zero[i] ? 0.0f : (res - 1) / z[i];
+        x[i] = next1 * scale;
+        y[i] = next2 * scale;
+    }
+
+    // Find the interval of the scale that contains z (branchless binary search)
+    uint32_t zi[BLOCK_SIZE] = {};
+    for (uint32_t len = res - 1; len > 1; )
+    {
+        const uint32_t half = len / 2;
+        for (size_t i = 0; i < BLOCK_SIZE; ++i)
+            zi[i] = a_scale[zi[i] + half] < z[i] ? zi[i] + half : zi[i];
+        len -= half;
+    }
+
+    // Trilinear interpolation weights, and offsets into the table
+    float x0[BLOCK_SIZE], x1[BLOCK_SIZE], y0[BLOCK_SIZE], y1[BLOCK_SIZE], z0[BLOCK_SIZE], z1[BLOCK_SIZE];
+    uint32_t off[BLOCK_SIZE];
+    for (size_t i = 0; i < BLOCK_SIZE; ++i)
+    {
+        const uint32_t xi = std::min((uint32_t)x[i], res - 2);
+        const uint32_t yi = std::min((uint32_t)y[i], res - 2);
+        off[i] = (((largest[i] * res + zi[i]) * res + yi) * res + xi) * COEFFS_N;
+
+        x1[i] = x[i] - xi;
+        x0[i] = 1.0f - x1[i];
+        y1[i] = y[i] - yi;
+        y0[i] = 1.0f - y1[i];
+        z1[i] = (z[i] - a_scale[zi[i]]) / (a_scale[zi[i] + 1] - a_scale[zi[i]]);
+        z0[i] = 1.0f - z1[i];
+    }
+
+    // Lookup
+    float coeffs[COEFFS_N][BLOCK_SIZE];
+    for (int j = 0; j < COEFFS_N; ++j)
+    {
+        for (size_t i = 0; i < BLOCK_SIZE; ++i)
         {
-            coeffs[j] = ((a_data[off] * x0 + a_data[off + dx] * x1) * y0 + (a_data[off + dy] * x0 + a_data[off + dy + dx] * x1) * y1) * z0 + ((a_data[off + dz] * x0 + a_data[off + dz + dx] * x1) * y0 + (a_data[off + dz + dy] * x0 + a_data[off + dz + dy + dx] * x1) * y1) * z1;
-            ++off;
+            const uint32_t o = off[i] + j;
+            coeffs[j][i] = ((a_data[o] * x0[i] + a_data[o + dx] * x1[i]) * y0[i] + (a_data[o + dy] * x0[i] + a_data[o + dy + dx] * x1[i]) * y1[i]) * z0[i] + ((a_data[o + dz] * x0[i] + a_data[o + dz + dx] * x1[i]) * y0[i] + (a_data[o + dz + dy] * x0[i] + a_data[o + dz + dy + dx] * x1[i]) * y1[i]) * z1[i];
         }
+    }
 
-        out_a[i*oa_slice] = coeffs[0];
-        out_b[i*ob_slice] = coeffs[1];
-        out_c[i*oc_slice] = coeffs[2];
+    for (size_t i = 0; i < elems; ++i)
+    {
+        out_a[i*oa_slice] = zero[i] ? ZERO_A : coeffs[0][i];
+        out_b[i*ob_slice] = zero[i] ? ZERO_B : coeffs[1][i];
+        out_c[i*oc_slice] = zero[i] ? ZERO_C : coeffs[2][i];
     }
 }
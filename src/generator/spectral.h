@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <memory>
+#include <cstdint>
 
 #include "runtime/color.h"
 
@@ -17,6 +18,12 @@ public:
 				float* out_a, size_t oa_slice, float* out_b, size_t ob_slice, float* out_c, size_t oc_slice, 
 				size_t elems) const;
 
+	// Converts a whole image in place, in parallel. Each pixel has the given number of channels, starting with rgb
+	void prepare_image(float* pixels, size_t channels, size_t elems) const;
+
+	// Hash of the coefficient table, used to detect stale conversions
+	uint64_t hash() const;
+
 	inline rgb upsample_rgb(const rgb &c) const
 	{
 		rgb v;
@@ -56,5 +63,9 @@ public:
 	}
 
 private:
+	void prepare_block(const float* r, size_t r_slice, const float* g, size_t g_slice, const float* b, size_t b_slice,
+				float* out_a, size_t oa_slice, float* out_b, size_t ob_slice, float* out_c, size_t oc_slice,
+				size_t elems) const;
+
 	std::unique_ptr<struct _SpectralUpsamplerInternal> mInternal;
 };
\ No newline at end of file
@@ -4,12 +4,173 @@
 #include <ostream>
 #include <istream>
 #include <fstream>
+#include <streambuf>
+#include <string>
+#include <cstdio>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
 
 #include <lz4.h>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include "common.h"
+
+// Buffers are stored in one of the following formats, told apart by their first 32-bit word:
+// - chunked: a header that starts with a magic number, followed by the chunk index (the offset past the end
+//   of each chunk, relative to the beginning of the compressed data, as 64-bit integers), and by the chunks.
+//   Each chunk is an LZ4 block that holds chunk_size bytes of the buffer (except the last, which holds the rest),
+//   so that buffers can exceed 4 GB, and that chunks can be decompressed in parallel,
+// - raw: uncompressed, preceded by a header that starts with another magic number. In that case, the data is aligned
+//   within the file, so that the file can be memory-mapped and the buffer used in place,
+// - single block (older files): one LZ4 block, preceded by the uncompressed and compressed sizes (as 32-bit integers).
+static constexpr uint32_t raw_buffer_magic = 0x57415242; // "BRAW"
+static constexpr size_t raw_buffer_alignment = 64;
+static constexpr uint32_t chunked_buffer_magic = 0x4B484342; // "BCHK"
+static constexpr size_t chunked_buffer_chunk_size = size_t(1) << 22;
+
+struct RawBufferHeader {
+    uint32_t magic;
+    uint32_t padding;   // Number of bytes between the end of the header and the data
+    uint64_t size;      // Size of the data, in bytes
+};
+
+struct ChunkedBufferHeader {
+    uint32_t magic;
+    uint32_t num_chunks;
+    uint64_t size;          // Size of the data once decompressed, in bytes
+    uint64_t chunk_size;    // Size of each chunk once decompressed, in bytes
+};
+
+/// Buffer stored in memory (e.g. in a memory-mapped file), as found by parse_buffer().
+struct BufferView {
+    const char* data;           // Stored (possibly compressed) data
+    size_t size;                // Size of the stored data, in bytes
+    size_t out_size;            // Size of the buffer once decompressed, in bytes
+    bool compressed;
+    const char* chunk_ends;     // Chunk index of chunked buffers, or nullptr for other formats
+    size_t num_chunks;
+    size_t chunk_size;
+
+    /// Offset past the end of the given chunk, relative to the beginning of the data (the index may not be aligned).
+    size_t chunk_end(size_t i) const {
+        uint64_t end = 0;
+        std::memcpy(&end, chunk_ends + i * sizeof(uint64_t), sizeof(uint64_t));
+        return end;
+    }
+};
+
+/// Returns whether write_buffer() compresses its output (the default), or writes raw, aligned buffers.
+inline bool& buffer_compression() {
+    static bool enabled = true;
+    return enabled;
+}
+
+inline void set_buffer_compression(bool enabled) {
+    buffer_compression() = enabled;
+}
+
+/// Parses the buffer that starts at the given offset in a block of memory.
+/// Returns the offset past the end of the buffer, or 0 if the buffer is truncated.
+inline size_t parse_buffer(const char* ptr, size_t offset, size_t total_size, BufferView& view) {
+    if (offset + 2 * sizeof(uint32_t) > total_size)
+        return 0;
+    uint32_t first = 0;
+    std::memcpy(&first, ptr + offset, sizeof(uint32_t));
+    view.chunk_ends = nullptr;
+    view.num_chunks = view.chunk_size = 0;
+    if (first == chunked_buffer_magic) {
+        ChunkedBufferHeader header;
+        if (offset + sizeof(ChunkedBufferHeader) > total_size)
+            return 0;
+        std::memcpy(&header, ptr + offset, sizeof(ChunkedBufferHeader));
+        offset += sizeof(ChunkedBufferHeader);
+        if (header.chunk_size == 0 || header.chunk_size > LZ4_MAX_INPUT_SIZE ||
+            header.num_chunks != (header.size + header.chunk_size - 1) / header.chunk_size ||
+            offset + header.num_chunks * sizeof(uint64_t) > total_size)
+            return 0;
+        view.chunk_ends = ptr + offset;
+        view.num_chunks = header.num_chunks;
+        view.chunk_size = header.chunk_size;
+        offset += header.num_chunks * sizeof(uint64_t);
+        view.data = ptr + offset;
+        view.size = header.num_chunks > 0 ? view.chunk_end(header.num_chunks - 1) : 0;
+        view.out_size = header.size;
+        view.compressed = true;
+    } else if (first == raw_buffer_magic) {
+        RawBufferHeader header;
+        if (offset + sizeof(RawBufferHeader) > total_size)
+            return 0;
+        std::memcpy(&header, ptr + offset, sizeof(RawBufferHeader));
+        offset += sizeof(RawBufferHeader) + header.padding;
+        view.data = ptr + offset;
+        view.size = view.out_size = header.size;
+        view.compressed = false;
+    } else {
+        uint32_t out_size = 0;
+        std::memcpy(&out_size, ptr + offset + sizeof(uint32_t), sizeof(uint32_t));
+        offset += 2 * sizeof(uint32_t);
+        view.data = ptr + offset;
+        view.size = out_size;
+        view.out_size = first;
+        view.compressed = true;
+    }
+    if (offset + view.size > total_size)
+        return 0;
+    return offset + view.size;
+}
+
+/// Copies or decompresses the contents of a buffer into the destination, which must hold out_size bytes.
+/// The chunks of chunked buffers are decompressed in parallel.
+inline bool unpack_buffer(const BufferView& view, void* out) {
+    if (!view.compressed) {
+        std::memcpy(out, view.data, view.size);
+        return true;
+    }
+    if (!view.chunk_ends)
+        return LZ4_decompress_safe(view.data, (char*)out, view.size, view.out_size) == int(view.out_size);
+
+    std::atomic<bool> ok(true);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, view.num_chunks, 1), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            size_t begin = i > 0 ? view.chunk_end(i - 1) : 0;
+            size_t end   = view.chunk_end(i);
+            size_t out_offset = i * view.chunk_size;
+            size_t out_size   = std::min(view.chunk_size, view.out_size - out_offset);
+            if (end < begin || end > view.size ||
+                LZ4_decompress_safe(view.data + begin, (char*)out + out_offset, end - begin, out_size) != int(out_size))
+                ok = false;
+        }
+    });
+    return ok;
+}
+
 static void skip_buffer(std::istream& is) {
     size_t in_size = 0, out_size = 0;
     is.read((char*)&in_size,  sizeof(uint32_t));
+    if (in_size == chunked_buffer_magic) {
+        ChunkedBufferHeader header;
+        is.read((char*)&header + sizeof(uint32_t), sizeof(ChunkedBufferHeader) - sizeof(uint32_t));
+        uint64_t size = 0;
+        if (header.num_chunks > 0) {
+            is.seekg((header.num_chunks - 1) * sizeof(uint64_t), std::ios::cur);
+            is.read((char*)&size, sizeof(uint64_t));
+        }
+        is.seekg(size, std::ios::cur);
+        return;
+    }
+    if (in_size == raw_buffer_magic) {
+        uint32_t padding = 0;
+        uint64_t size = 0;
+        is.read((char*)&padding, sizeof(uint32_t));
+        is.read((char*)&size,    sizeof(uint64_t));
+        is.seekg(padding + size, std::ios::cur);
+        return;
+    }
     is.read((char*)&out_size, sizeof(uint32_t));
     is.seekg(out_size, std::ios::cur);
 }
@@ -23,6 +184,35 @@ template <typename Array>
 static void read_buffer(std::istream& is, Array& array) {
     size_t in_size = 0, out_size = 0;
     is.read((char*)&in_size,  sizeof(uint32_t));
+    if (in_size == chunked_buffer_magic) {
+        // Read the whole buffer in memory, and decompress it from there
+        ChunkedBufferHeader header;
+        header.magic = chunked_buffer_magic;
+        is.read((char*)&header + sizeof(uint32_t), sizeof(ChunkedBufferHeader) - sizeof(uint32_t));
+        std::vector<char> in(sizeof(ChunkedBufferHeader) + header.num_chunks * sizeof(uint64_t));
+        std::memcpy(in.data(), &header, sizeof(ChunkedBufferHeader));
+        is.read(in.data() + sizeof(ChunkedBufferHeader), in.size() - sizeof(ChunkedBufferHeader));
+        uint64_t size = 0;
+        if (header.num_chunks > 0)
+            std::memcpy(&size, in.data() + in.size() - sizeof(uint64_t), sizeof(uint64_t));
+        in.resize(in.size() + size);
+        is.read(in.data() + in.size() - size, size);
+        BufferView view;
+        array = std::move(Array(header.size / sizeof(array[0])));
+        if (!is || !parse_buffer(in.data(), 0, in.size(), view) || !unpack_buffer(view, array.data()))
+            array = std::move(Array());
+        return;
+    }
+    if (in_size == raw_buffer_magic) {
+        uint32_t padding = 0;
+        uint64_t size = 0;
+        is.read((char*)&padding, sizeof(uint32_t));
+        is.read((char*)&size,    sizeof(uint64_t));
+        is.seekg(padding, std::ios::cur);
+        array = std::move(Array(size / sizeof(array[0])));
+        is.read((char*)array.data(), size);
+        return;
+    }
     is.read((char*)&out_size, sizeof(uint32_t));
     std::vector<char> in(out_size);
     is.read(in.data(), in.size());
@@ -36,28 +226,161 @@ static void read_buffer(const std::string& file_name, Array& array) {
     read_buffer(is, array);
 }
 
+// Compresses each chunk of the data in parallel
+inline void compress_chunks(const char* in, size_t in_size, size_t chunk_size, std::vector<std::vector<char>>& chunks) {
+    chunks.resize((in_size + chunk_size - 1) / chunk_size);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size(), 1), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            auto size = std::min(chunk_size, in_size - i * chunk_size);
+            chunks[i].resize(LZ4_compressBound(size));
+            auto compressed_size = LZ4_compress_default(in + i * chunk_size, chunks[i].data(), size, chunks[i].size());
+            if (compressed_size <= 0)
+                error("Cannot compress chunk ", i, " of a buffer (", size, " bytes)");
+            chunks[i].resize(compressed_size);
+        }
+    });
+}
+
 template <typename Array>
-static void compress(const Array& in, std::vector<char>& out) {
-    size_t in_size = sizeof(in[0]) * in.size();
-    out.resize(LZ4_compressBound(in_size));
-    out.resize(LZ4_compress_default((const char*)in.data(), out.data(), in_size, out.size()));
+static void write_raw_buffer(std::ostream& os, const Array& array) {
+    // Align the data with respect to the beginning of the file
+    auto pos = os.tellp();
+    size_t data_pos = pos < 0 ? sizeof(RawBufferHeader) : size_t(pos) + sizeof(RawBufferHeader);
+    RawBufferHeader header;
+    header.magic   = raw_buffer_magic;
+    header.padding = (raw_buffer_alignment - data_pos % raw_buffer_alignment) % raw_buffer_alignment;
+    header.size    = sizeof(array[0]) * array.size();
+    const char zeros[raw_buffer_alignment] = {};
+    os.write((char*)&header, sizeof(RawBufferHeader));
+    os.write(zeros, header.padding);
+    os.write((const char*)array.data(), header.size);
 }
 
 template <typename Array>
 static void write_buffer(std::ostream& os, const Array& array) {
-    std::vector<char> out;
-    compress(array, out);
-    size_t in_size  = sizeof(array[0]) * array.size();
-    size_t out_size = out.size();
-    os.write((char*)&in_size,  sizeof(uint32_t));
-    os.write((char*)&out_size, sizeof(uint32_t));
-    os.write(out.data(), out.size());
+    if (!buffer_compression()) {
+        write_raw_buffer(os, array);
+        return;
+    }
+    std::vector<std::vector<char>> chunks;
+    ChunkedBufferHeader header;
+    header.magic      = chunked_buffer_magic;
+    header.size       = sizeof(array[0]) * array.size();
+    header.chunk_size = chunked_buffer_chunk_size;
+    compress_chunks((const char*)array.data(), header.size, header.chunk_size, chunks);
+    header.num_chunks = chunks.size();
+    os.write((char*)&header, sizeof(ChunkedBufferHeader));
+    uint64_t end = 0;
+    for (auto& chunk : chunks) {
+        end += chunk.size();
+        os.write((char*)&end, sizeof(uint64_t));
+    }
+    for (auto& chunk : chunks)
+        os.write(chunk.data(), chunk.size());
 }
 
+/// Output stream buffer that only writes a file when its contents change, so that build systems do not consider
+/// unchanged files out of date. The data is compared with the existing file block by block. From the first
+/// difference on, it goes to a temporary file, which replaces the file in commit(). Unless commit() is called,
+/// the existing file is left untouched.
+class FileUpdateBuf : public std::streambuf {
+public:
+    explicit FileUpdateBuf(const std::string& file_name)
+        : file_name_(file_name), tmp_name_(file_name + ".tmp"), old_(file_name, std::ios::binary), block_(block_size), cmp_(block_size)
+    {
+        setp(block_.data(), block_.data() + block_.size());
+    }
+
+    ~FileUpdateBuf() {
+        if (tmp_.is_open()) {
+            tmp_.close();
+            std::remove(tmp_name_.c_str());
+        }
+    }
+
+    /// Finishes writing, and replaces the file if its contents changed. Returns whether the file has been written.
+    bool commit() {
+        flush_block();
+        if (!changed_) {
+            if (old_.is_open() && old_.peek() == std::char_traits<char>::eof())
+                return false;
+            start_writing();
+        }
+        tmp_.close();
+        old_.close();
+#ifdef _WIN32
+        std::remove(file_name_.c_str());
+#endif
+        if (std::rename(tmp_name_.c_str(), file_name_.c_str()) != 0) {
+            std::remove(tmp_name_.c_str());
+            error("Cannot replace '", file_name_, "' with '", tmp_name_, "'");
+        }
+        return true;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        flush_block();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            sputc(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    // Only reports the position, which write_raw_buffer() uses to align the data
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+        if (off != 0 || dir != std::ios_base::cur)
+            return pos_type(off_type(-1));
+        return pos_type(off_type(pos_ + (pptr() - pbase())));
+    }
+
+private:
+    static constexpr size_t block_size = 1 << 16;
+
+    void flush_block() {
+        auto n = size_t(pptr() - pbase());
+        if (!changed_) {
+            if (!old_.is_open() || !old_.read(cmp_.data(), n) || std::memcmp(cmp_.data(), pbase(), n) != 0)
+                start_writing();
+        }
+        if (changed_)
+            tmp_.write(pbase(), n);
+        pos_ += n;
+        setp(block_.data(), block_.data() + block_.size());
+    }
+
+    // Copies the part of the file that has been found identical so far, and switches to writing
+    void start_writing() {
+        changed_ = true;
+        tmp_.open(tmp_name_, std::ios::binary);
+        if (old_.is_open()) {
+            old_.clear();
+            old_.seekg(0);
+            for (size_t copied = 0; copied < pos_;) {
+                auto n = std::min(pos_ - copied, cmp_.size());
+                old_.read(cmp_.data(), n);
+                tmp_.write(cmp_.data(), n);
+                copied += n;
+            }
+            old_.close();
+        }
+    }
+
+    std::string file_name_;
+    std::string tmp_name_;
+    std::ifstream old_;
+    std::ofstream tmp_;
+    std::vector<char> block_;
+    std::vector<char> cmp_;
+    size_t pos_ = 0;
+    bool changed_ = false;
+};
+
 template <typename Array>
 static void write_buffer(const std::string& file_name, const Array& array) {
-    std::ofstream of(file_name, std::ios::binary);
-    write_buffer(of, array);
+    FileUpdateBuf buf(file_name);
+    std::ostream os(&buf);
+    write_buffer(os, array);
+    buf.commit();
 }
 
 #endif // BUFFER_H
@@ -2,12 +2,21 @@
 #define BVH_H
 
 #include <cstdint>
+#include <cmath>
 #include <functional>
 #include <cassert>
 #include <chrono>
 #include <iostream>
 #include <limits>
 #include <stack>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_group.h>
 
 #include "common.h"
 #include "float4.h"
@@ -24,11 +33,13 @@ public:
     template <typename T>
     T* alloc(size_t count) {
         size_t size = count * sizeof(T);
+        std::lock_guard<std::mutex> lock(mutex_);
         chunks_.emplace_back(alloc_.allocate(size), size);
         return reinterpret_cast<T*>(chunks_.back().first);
     }
 
     void cleanup() {
+        std::lock_guard<std::mutex> lock(mutex_);
         for (auto chunk: chunks_)
             alloc_.deallocate(chunk.first, chunk.second);
         chunks_.clear();
@@ -38,6 +49,7 @@ private:
     typedef std::pair<uint8_t*, size_t> Chunk;
 
     std::vector<Chunk> chunks_;
+    std::mutex mutex_;
     Allocator alloc_;
 };
 
@@ -96,9 +108,12 @@ struct MultiNode {
 };
 
 /// Builds a SBVH (Spatial split BVH), given the set of triangles and the alpha parameter
-/// that controls when to do a spatial split. The tree is built in depth-first order.
+/// that controls when to do a spatial split. Object splits are found by binning the
+/// reference centroids (exact sweeps are used for small nodes), and independent subtrees
+/// are built in parallel using TBB tasks. The resulting tree is emitted in depth-first order.
 /// See  Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009
 /// http://www.nvidia.com/docs/IO/77714/sbvh.pdf
+/// and Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies", 2007
 template <size_t N, typename CostFn>
 class SplitBvhBuilder {
 public:
@@ -114,107 +129,38 @@ public:
         const size_t tri_count = tris.size();
 
         Ref* initial_refs = mem_pool_.alloc<Ref>(tri_count);
-        right_bbs_ = mem_pool_.alloc<BBox>(std::max(spatial_bins(), tri_count));
-        BBox mesh_bb = BBox::empty();
-        for (size_t i = 0; i < tri_count; i++) {
-            const Tri& tri = tris[i];
-            tri.compute_bbox(initial_refs[i].bb);
-            mesh_bb.extend(initial_refs[i].bb);
-            initial_refs[i].id = i;
-        }
-
-        const float spatial_threshold = mesh_bb.half_area() * alpha;
-
-        std::stack<Node> stack;
-        stack.emplace(initial_refs, tri_count, mesh_bb, -1);
-
-        std::vector<float3> centers(tris.size());
-        for (size_t i = 0; i < tris.size(); ++i)
-            centers[i] = (tris[i].v0 + tris[i].v1 + tris[i].v2) * (1.0f / 3.0f);
-
+        centers_.resize(tri_count);
+        const BBox mesh_bb = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, tri_count, binning_grain()), BBox::empty(),
+            [&] (const tbb::blocked_range<size_t>& range, BBox bb) {
+                for (size_t i = range.begin(); i < range.end(); i++) {
+                    const Tri& tri = tris[i];
+                    tri.compute_bbox(initial_refs[i].bb);
+                    initial_refs[i].id = i;
+                    centers_[i] = (tri.v0 + tri.v1 + tri.v2) * (1.0f / 3.0f);
+                    bb.extend(initial_refs[i].bb);
+                }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
+
+        tris_ = &tris;
+        leaf_threshold_ = leaf_threshold;
+        spatial_threshold_ = mesh_bb.half_area() * alpha;
+
+        // Subtrees are built concurrently, and all the tasks are attached to the same group
+        TreeNode* root = nullptr;
+        tbb::task_group group;
+        build_subtree(Node(initial_refs, tri_count, mesh_bb, -1), &root, group);
+        group.wait();
+
+        // The tree is written sequentially, in the same order as a depth-first build
+        std::stack<TreeNode*> stack;
+        stack.push(root);
         while (!stack.empty()) {
-            MultiNode<Node, N> multi_node(stack.top());
+            TreeNode* tree_node = stack.top();
+            auto& multi_node = tree_node->multi_node;
             stack.pop();
 
-            // Iterate over the available split candidates in the multi-node
-            while (!multi_node.is_full() && multi_node.node_available()) {
-                const int node_id = multi_node.next_node();
-                Node node = multi_node.nodes[node_id];
-                Ref* refs = node.refs;
-                auto ref_count = node.ref_count;
-                const BBox& parent_bb = node.bbox;
-                assert(ref_count != 0);
-
-                if (ref_count <= leaf_threshold) {
-                    // This candidate does not have enough triangles
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
-                }
-
-                // Try object splits
-                ObjectSplit object_split;
-                for (size_t axis = 0; axis < 3; axis++)
-                    find_object_split(object_split, centers.data(), axis, refs, ref_count);
-
-                SpatialSplit spatial_split;
-                if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold) {
-                    // Try spatial splits
-                    for (size_t axis = 0; axis < 3; axis++) {
-                        if (parent_bb.min[axis] == parent_bb.max[axis])
-                            continue;
-                        find_spatial_split(spatial_split, parent_bb, tris, axis, refs, ref_count);
-                    }
-                }
-
-                bool spatial = spatial_split.cost < object_split.cost;
-                const float split_cost = spatial ? spatial_split.cost : object_split.cost;
-
-                if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
-                    // Split is not beneficial
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
-                }
-
-                if (spatial) {
-                    Ref* left_refs, *right_refs;
-                    BBox left_bb, right_bb;
-                    size_t left_count, right_count;
-                    apply_spatial_split(spatial_split, tris,
-                                        refs, ref_count,
-                                        left_refs, left_count, left_bb,
-                                        right_refs, right_count, right_bb);
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  left_bb, multi_node.parent),
-                                          Node(right_refs, right_count, right_bb, multi_node.parent));
-
-#ifdef STATISTICS
-                    spatial_splits_++;
-#endif
-                } else {
-                    // Partitioning can be done in-place
-                    apply_object_split(object_split, centers.data(), refs, ref_count);
-
-                    const size_t right_count = ref_count - object_split.left_count;
-                    const size_t left_count = object_split.left_count;
-
-                    Ref *right_refs = refs + object_split.left_count;
-                    Ref* left_refs = refs;
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  object_split.left_bb, multi_node.parent),
-                                          Node(right_refs, right_count, object_split.right_bb, multi_node.parent));
-#ifdef STATISTICS
-                    object_splits_++;
-#endif
-                }
-            }
-
-            assert(multi_node.count > 0);
-            // Sort nodes in order of decreasing size
-            multi_node.sort_nodes();
-
-            // The multi-node is ready to be stored
             if (multi_node.is_leaf()) {
                 // Store a leaf if it could not be split
                 Node& node = multi_node.nodes[0];
@@ -229,10 +175,14 @@ public:
 
                 for (int i = 0; i < multi_node.count; i++) {
                     multi_node.nodes[i].parent = parent * N + i;
-                    if (multi_node.nodes[i].tested)
+                    if (multi_node.nodes[i].tested) {
                         make_leaf(multi_node.nodes[i], write_leaf);
-                    else
-                        stack.push(multi_node.nodes[i]);
+                    } else {
+                        auto child = tree_node->children[i];
+                        child->multi_node.parent = parent * N + i;
+                        child->multi_node.nodes[0].parent = parent * N + i;
+                        stack.push(child);
+                    }
                 }
             }
         }
@@ -242,12 +192,13 @@ public:
         total_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start);
 #endif
 
+        centers_.clear();
         mem_pool_.cleanup();
     }
 
 #ifdef STATISTICS
     void print_stats() const {
-        std::cout << "BVH built in " << total_time_ << "ms ("
+        std::cout << "BVH built in " << total_time_.count() << "ms ("
                   << total_nodes_ << " nodes, "
                   << total_leaves_ << " leaves, "
                   << object_splits_ << " object splits, "
@@ -260,6 +211,14 @@ public:
 private:
     static constexpr size_t spatial_bins() { return 96; }
     static constexpr size_t binning_passes() { return 2; }
+    static constexpr size_t object_bins() { return 32; }
+    /// Nodes with fewer references use a full SAH sweep instead of binning
+    static constexpr size_t sweep_threshold() { return 64; }
+    /// Nodes with at least that many references are built in a separate task
+    static constexpr size_t task_threshold() { return 1024; }
+    /// Nodes with at least that many references are binned in parallel
+    static constexpr size_t parallel_binning_threshold() { return 1 << 14; }
+    static constexpr size_t binning_grain() { return 4096; }
 
     struct Ref {
         uint32_t id;
@@ -275,13 +234,24 @@ private:
         size_t exit;
     };
 
+    struct ObjectBin {
+        BBox bb;
+        size_t count;
+    };
+
+    using SpatialBins = std::array<Bin, spatial_bins()>;
+    using ObjectBins  = std::array<ObjectBin, 3 * object_bins()>;
+
     struct ObjectSplit {
         size_t axis;
         float cost;
         BBox left_bb, right_bb;
         size_t left_count;
+        int bin;              // Last bin on the left side, or -1 if the split comes from a sweep
+        float bin_offset;
+        float bin_scale;
 
-        ObjectSplit() : cost(std::numeric_limits<float>::max()) {}
+        ObjectSplit() : cost(std::numeric_limits<float>::max()), bin(-1) {}
     };
 
     struct SpatialSplit {
@@ -311,6 +281,124 @@ private:
         int size() const { return ref_count; }
     };
 
+    /// Multi-node of the intermediate tree. Children that have been tested are
+    /// leaves, the others point to the multi-node built from them.
+    struct TreeNode {
+        MultiNode<Node, N> multi_node;
+        TreeNode* children[N];
+
+        TreeNode(const MultiNode<Node, N>& multi_node)
+            : multi_node(multi_node)
+        {
+            std::fill(children, children + N, nullptr);
+        }
+    };
+
+    void build_subtree(const Node& root, TreeNode** root_slot, tbb::task_group& group) {
+        std::stack<std::pair<Node, TreeNode**>> stack;
+        stack.emplace(root, root_slot);
+
+        while (!stack.empty()) {
+            MultiNode<Node, N> multi_node(stack.top().first);
+            TreeNode** slot = stack.top().second;
+            stack.pop();
+
+            // Iterate over the available split candidates in the multi-node
+            while (!multi_node.is_full() && multi_node.node_available()) {
+                const int node_id = multi_node.next_node();
+                Node node = multi_node.nodes[node_id];
+                Ref* refs = node.refs;
+                auto ref_count = node.ref_count;
+                const BBox& parent_bb = node.bbox;
+                assert(ref_count != 0);
+
+                if (ref_count <= leaf_threshold_) {
+                    // This candidate does not have enough triangles
+                    multi_node.nodes[node_id].tested = true;
+                    continue;
+                }
+
+                // Try object splits
+                ObjectSplit object_split;
+                find_object_split(object_split, refs, ref_count);
+
+                SpatialSplit spatial_split;
+                if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold_) {
+                    // Try spatial splits
+                    for (size_t axis = 0; axis < 3; axis++) {
+                        if (parent_bb.min[axis] == parent_bb.max[axis])
+                            continue;
+                        find_spatial_split(spatial_split, parent_bb, axis, refs, ref_count);
+                    }
+                }
+
+                bool spatial = spatial_split.cost < object_split.cost;
+                const float split_cost = spatial ? spatial_split.cost : object_split.cost;
+
+                if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
+                    // Split is not beneficial
+                    multi_node.nodes[node_id].tested = true;
+                    continue;
+                }
+
+                if (spatial) {
+                    Ref* left_refs, *right_refs;
+                    BBox left_bb, right_bb;
+                    size_t left_count, right_count;
+                    apply_spatial_split(spatial_split,
+                                        refs, ref_count,
+                                        left_refs, left_count, left_bb,
+                                        right_refs, right_count, right_bb);
+
+                    multi_node.split_node(node_id,
+                                          Node(left_refs,  left_count,  left_bb, multi_node.parent),
+                                          Node(right_refs, right_count, right_bb, multi_node.parent));
+
+#ifdef STATISTICS
+                    spatial_splits_.fetch_add(1, std::memory_order_relaxed);
+#endif
+                } else {
+                    // Partitioning can be done in-place
+                    apply_object_split(object_split, refs, ref_count);
+
+                    const size_t right_count = ref_count - object_split.left_count;
+                    const size_t left_count = object_split.left_count;
+
+                    Ref *right_refs = refs + object_split.left_count;
+                    Ref* left_refs = refs;
+
+                    multi_node.split_node(node_id,
+                                          Node(left_refs,  left_count,  object_split.left_bb, multi_node.parent),
+                                          Node(right_refs, right_count, object_split.right_bb, multi_node.parent));
+#ifdef STATISTICS
+                    object_splits_.fetch_add(1, std::memory_order_relaxed);
+#endif
+                }
+            }
+
+            assert(multi_node.count > 0);
+            // Sort nodes in order of decreasing size
+            multi_node.sort_nodes();
+
+            TreeNode* tree_node = new (mem_pool_.alloc<TreeNode>(1)) TreeNode(multi_node);
+            *slot = tree_node;
+            if (multi_node.is_leaf())
+                continue;
+
+            // Children are disjoint sets of references, so they can be processed concurrently
+            for (int i = 0; i < multi_node.count; i++) {
+                const Node& child = tree_node->multi_node.nodes[i];
+                if (child.tested)
+                    continue;
+                TreeNode** child_slot = &tree_node->children[i];
+                if (child.ref_count >= task_threshold())
+                    group.run([this, child, child_slot, &group] { build_subtree(child, child_slot, group); });
+                else
+                    stack.emplace(child, child_slot);
+            }
+        }
+    }
+
     template <typename NodeWriter>
     int make_node(const MultiNode<Node, N>& multi_node, NodeWriter write_node) {
         int node_id = write_node(multi_node.parent / N, multi_node.parent % N, multi_node.bbox, multi_node.count, [&] (int i) {
@@ -333,87 +421,235 @@ private:
 #endif
     }
 
-    void sort_refs(size_t axis, float3* centers, Ref* refs, size_t ref_count) {
+    /// Runs the given binning function over the references, in parallel if there are enough of them.
+    template <typename Bins, typename BinFn, typename MergeFn>
+    Bins bin_refs(size_t ref_count, const Bins& empty, BinFn bin, MergeFn merge) {
+        if (ref_count < parallel_binning_threshold())
+            return bin(tbb::blocked_range<size_t>(0, ref_count), empty);
+        return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, ref_count, binning_grain()), empty, bin, merge);
+    }
+
+    float ref_center(const Ref& ref, size_t axis) const {
+        return clamp(centers_[ref.id][axis], ref.bb.min[axis], ref.bb.max[axis]);
+    }
+
+    static int object_bin(float center, float offset, float scale) {
+        return clamp(int((center - offset) * scale), int(0), int(object_bins() - 1));
+    }
+
+    void sort_refs(size_t axis, Ref* refs, size_t ref_count) {
         // Sort the primitives based on their centroids
-        std::sort(refs, refs + ref_count, [axis, centers] (const Ref& a, const Ref& b) {
-            const float ca = clamp(centers[a.id][axis], a.bb.min[axis], a.bb.max[axis]);
-            const float cb = clamp(centers[b.id][axis], b.bb.min[axis], b.bb.max[axis]);
+        std::sort(refs, refs + ref_count, [this, axis] (const Ref& a, const Ref& b) {
+            const float ca = ref_center(a, axis);
+            const float cb = ref_center(b, axis);
             return (ca < cb) || (ca == cb && a.id < b.id);
         });
     }
 
-    void find_object_split(ObjectSplit& split, float3* centers, size_t axis, Ref* refs, size_t ref_count) {
+    void find_object_split(ObjectSplit& split, Ref* refs, size_t ref_count) {
+        assert(ref_count > 1);
+
+        if (ref_count > sweep_threshold()) {
+            find_binned_object_split(split, refs, ref_count);
+            if (split.bin >= 0)
+                return;
+        }
+
+        // Small nodes, or nodes where all the centroids are identical
+        for (size_t axis = 0; axis < 3; axis++)
+            find_sweep_object_split(split, axis, refs, ref_count);
+    }
+
+    void find_sweep_object_split(ObjectSplit& split, size_t axis, Ref* refs, size_t ref_count) {
         assert(ref_count > 0);
 
-        sort_refs(axis, centers, refs, ref_count);
+        BBox small_right_bbs[sweep_threshold()];
+        std::vector<BBox> large_right_bbs;
+        BBox* right_bbs = small_right_bbs;
+        if (ref_count > sweep_threshold()) {
+            large_right_bbs.resize(ref_count);
+            right_bbs = large_right_bbs.data();
+        }
+
+        sort_refs(axis, refs, ref_count);
 
         // Sweep from the right and accumulate the bounding boxes
         BBox cur_bb = BBox::empty();
         for (int i = ref_count - 1; i > 0; i--) {
             cur_bb.extend(refs[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
         cur_bb = BBox::empty();
         for (size_t i = 0; i < ref_count - 1; i++) {
             cur_bb.extend(refs[i].bb);
-            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs_[i].half_area());
+            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs[i].half_area());
             if (cost < split.cost) {
                 split.axis = axis;
                 split.cost = cost;
                 split.left_count = i + 1;
                 split.left_bb = cur_bb;
-                split.right_bb = right_bbs_[i];
+                split.right_bb = right_bbs[i];
+                split.bin = -1;
             }
         }
 
         assert(split.left_count != 0 && split.left_count != ref_count);
     }
 
-    void apply_object_split(const ObjectSplit& split, float3* centers, Ref* refs, int ref_count) {
-        if (split.axis != 2) sort_refs(split.axis, centers, refs, ref_count);
+    void find_binned_object_split(ObjectSplit& split, Ref* refs, size_t ref_count) {
+        // Compute the bounding box of the centroids
+        const BBox center_bb = bin_refs(ref_count, BBox::empty(),
+            [&] (const tbb::blocked_range<size_t>& range, BBox bb) {
+                for (size_t i = range.begin(); i < range.end(); i++) {
+                    const Ref& ref = refs[i];
+                    bb.extend(float3(ref_center(ref, 0), ref_center(ref, 1), ref_center(ref, 2)));
+                }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
+
+        float offsets[3], scales[3];
+        for (size_t axis = 0; axis < 3; axis++) {
+            const float extent = center_bb.max[axis] - center_bb.min[axis];
+            offsets[axis] = center_bb.min[axis];
+            scales[axis] = extent > 0.0f ? object_bins() / extent : 0.0f;
+        }
+
+        // Put the references in the bins of the three axes at once
+        ObjectBins empty_bins;
+        for (auto& bin : empty_bins) {
+            bin.bb = BBox::empty();
+            bin.count = 0;
+        }
+        const ObjectBins bins = bin_refs(ref_count, empty_bins,
+            [&] (const tbb::blocked_range<size_t>& range, ObjectBins bins) {
+                for (size_t i = range.begin(); i < range.end(); i++) {
+                    const Ref& ref = refs[i];
+                    for (size_t axis = 0; axis < 3; axis++) {
+                        auto& bin = bins[axis * object_bins() + object_bin(ref_center(ref, axis), offsets[axis], scales[axis])];
+                        bin.bb.extend(ref.bb);
+                        bin.count++;
+                    }
+                }
+                return bins;
+            },
+            [] (ObjectBins a, const ObjectBins& b) {
+                for (size_t i = 0; i < a.size(); i++) {
+                    a[i].bb.extend(b[i].bb);
+                    a[i].count += b[i].count;
+                }
+                return a;
+            });
+
+        for (size_t axis = 0; axis < 3; axis++) {
+            if (scales[axis] == 0.0f)
+                continue;
+
+            const ObjectBin* axis_bins = bins.data() + axis * object_bins();
+
+            // Sweep from the right and accumulate the bounding boxes
+            BBox right_bbs[object_bins()];
+            BBox cur_bb = BBox::empty();
+            for (int i = object_bins() - 1; i > 0; i--) {
+                cur_bb.extend(axis_bins[i].bb);
+                right_bbs[i - 1] = cur_bb;
+            }
+
+            // Sweep from the left and compute the SAH cost
+            size_t left_count = 0;
+            cur_bb = BBox::empty();
+            for (size_t i = 0; i < object_bins() - 1; i++) {
+                left_count += axis_bins[i].count;
+                cur_bb.extend(axis_bins[i].bb);
+
+                if (left_count == 0 || left_count == ref_count)
+                    continue;
+
+                const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - left_count, right_bbs[i].half_area());
+                if (cost < split.cost) {
+                    split.axis = axis;
+                    split.cost = cost;
+                    split.left_count = left_count;
+                    split.left_bb = cur_bb;
+                    split.right_bb = right_bbs[i];
+                    split.bin = i;
+                    split.bin_offset = offsets[axis];
+                    split.bin_scale = scales[axis];
+                }
+            }
+        }
+    }
+
+    void apply_object_split(const ObjectSplit& split, Ref* refs, size_t ref_count) {
+        if (split.bin < 0) {
+            // The references are already sorted along the last axis of the sweep
+            if (split.axis != 2) sort_refs(split.axis, refs, ref_count);
+        } else {
+            auto mid = std::partition(refs, refs + ref_count, [&] (const Ref& ref) {
+                return object_bin(ref_center(ref, split.axis), split.bin_offset, split.bin_scale) <= split.bin;
+            });
+            assert(size_t(mid - refs) == split.left_count);
+            (void)mid;
+        }
     }
 
-    size_t spatial_binning(Bin* bins, size_t num_bins, SpatialSplit& split,
-                           const std::vector<Tri>& tris, size_t axis,
+    size_t spatial_binning(SpatialSplit& split, size_t axis,
                            Ref* refs, size_t ref_count,
                            float axis_min, float axis_max) {
+        const size_t num_bins = spatial_bins();
+        const auto& tris = *tris_;
+
         // Initialize bins
-        for (size_t i = 0; i < num_bins; i++) {
-            bins[i].entry = 0;
-            bins[i].exit = 0;
-            bins[i].bb = BBox::empty();
+        SpatialBins empty_bins;
+        for (auto& bin : empty_bins) {
+            bin.entry = 0;
+            bin.exit = 0;
+            bin.bb = BBox::empty();
         }
 
         // Put the primitives in the bins
         const float bin_size = (axis_max - axis_min) / num_bins;
         const float inv_size = 1.0f / bin_size;
-        for (size_t i = 0; i < ref_count; i++) {
-            const Ref& ref = refs[i];
-
-            const size_t first_bin = clamp(int(inv_size * (ref.bb.min[axis] - axis_min)), int(0), int(num_bins - 1));
-            const size_t last_bin  = clamp(int(inv_size * (ref.bb.max[axis] - axis_min)), int(0), int(num_bins - 1));
-            assert(first_bin <= last_bin);
-
-            BBox cur_bb = ref.bb;
-            for (size_t j = first_bin; j < last_bin; j++) {
-                BBox left_bb, right_bb;
-                tris[ref.id].compute_split(left_bb, right_bb, axis, j < num_bins - 1 ? axis_min + (j + 1) * bin_size : axis_max);
-                bins[j].bb.extend(left_bb.overlap(cur_bb));
-                cur_bb.overlap(right_bb);
-            }
+        const SpatialBins bins = bin_refs(ref_count, empty_bins,
+            [&] (const tbb::blocked_range<size_t>& range, SpatialBins bins) {
+                for (size_t i = range.begin(); i < range.end(); i++) {
+                    const Ref& ref = refs[i];
+
+                    const size_t first_bin = clamp(int(inv_size * (ref.bb.min[axis] - axis_min)), int(0), int(num_bins - 1));
+                    const size_t last_bin  = clamp(int(inv_size * (ref.bb.max[axis] - axis_min)), int(0), int(num_bins - 1));
+                    assert(first_bin <= last_bin);
+
+                    BBox cur_bb = ref.bb;
+                    for (size_t j = first_bin; j < last_bin; j++) {
+                        BBox left_bb, right_bb;
+                        tris[ref.id].compute_split(left_bb, right_bb, axis, j < num_bins - 1 ? axis_min + (j + 1) * bin_size : axis_max);
+                        bins[j].bb.extend(left_bb.overlap(cur_bb));
+                        cur_bb.overlap(right_bb);
+                    }
 
-            bins[last_bin].bb.extend(cur_bb);
-            bins[first_bin].entry++;
-            bins[last_bin].exit++;
-        }
+                    bins[last_bin].bb.extend(cur_bb);
+                    bins[first_bin].entry++;
+                    bins[last_bin].exit++;
+                }
+                return bins;
+            },
+            [] (SpatialBins a, const SpatialBins& b) {
+                for (size_t i = 0; i < a.size(); i++) {
+                    a[i].bb.extend(b[i].bb);
+                    a[i].entry += b[i].entry;
+                    a[i].exit  += b[i].exit;
+                }
+                return a;
+            });
 
         // Sweep from the right and accumulate the bounding boxes
+        BBox right_bbs[spatial_bins()];
         BBox cur_bb = BBox::empty();
         for (int i = num_bins - 1; i > 0; i--) {
             cur_bb.extend(bins[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
@@ -427,7 +663,7 @@ private:
             cur_bb.extend(bins[i].bb);
 
             if (left_count != ref_count && right_count != ref_count) {
-                const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs_[i].half_area());
+                const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs[i].half_area());
                 if (cost < split.cost) {
                     split.axis = axis;
                     split.cost = cost;
@@ -440,19 +676,17 @@ private:
         return split_index;
     }
 
-    void find_spatial_split(SpatialSplit& split, const BBox& parent_bb,
-                            const std::vector<Tri>& tris, size_t axis,
+    void find_spatial_split(SpatialSplit& split, const BBox& parent_bb, size_t axis,
                             Ref* refs, size_t ref_count) {
         float axis_min = parent_bb.min[axis];
         float axis_max = parent_bb.max[axis];
         assert(axis_max > axis_min);
-        Bin bins[spatial_bins()];
         size_t n = 0;
 
         do {
             if (axis_max <= axis_min) break;
 
-            size_t split_index = spatial_binning(bins, spatial_bins(), split, tris, axis, refs, ref_count, axis_min, axis_max);
+            size_t split_index = spatial_binning(split, axis, refs, ref_count, axis_min, axis_max);
             if (split_index == size_t(-1)) break;
 
             float bin_size = (axis_max - axis_min) / spatial_bins();
@@ -463,10 +697,11 @@ private:
     }
 
     void apply_spatial_split(const SpatialSplit& split,
-                             const std::vector<Tri>& tris,
                              Ref* refs, size_t ref_count,
                              Ref*& left_refs, size_t& left_count, BBox& left_bb,
                              Ref*& right_refs, size_t& right_count, BBox& right_bb) {
+        const auto& tris = *tris_;
+
         // Split the reference array in three parts:
         // [0.. left_count[ : references that are completely on the left
         // [left_count.. first_right[ : references that lie in between
@@ -556,17 +791,64 @@ private:
 
 
 #ifdef STATISTICS
-    std::chrono::duration<std::chrono::milliseconds> total_time_ = 0;
-    size_t total_nodes_ = 0;
-    size_t total_leaves_ = 0;
-    size_t total_refs_ = 0;
-    size_t total_tris_ = 0;
-    size_t spatial_splits_ = 0;
-    size_t object_splits_ = 0;
+    // The counters are atomic, since the subtrees are built by concurrent tasks
+    std::chrono::milliseconds total_time_{0};
+    std::atomic<size_t> total_nodes_{0};
+    std::atomic<size_t> total_leaves_{0};
+    std::atomic<size_t> total_refs_{0};
+    std::atomic<size_t> total_tris_{0};
+    std::atomic<size_t> spatial_splits_{0};
+    std::atomic<size_t> object_splits_{0};
 #endif
 
-    BBox* right_bbs_;
+    const std::vector<Tri>* tris_;
+    std::vector<float3> centers_;
+    size_t leaf_threshold_;
+    float spatial_threshold_;
     MemoryPool<> mem_pool_;
 };
 
+/// Compresses a wide BVH node by quantizing the bounding boxes of its children on an 8-bit grid
+/// placed on the union of the children (see "Efficient Incoherent Ray Traversal on GPUs Through
+/// Compressed Wide BVHs", Ylitie et al.). The grid cells have a power of two size, and the boxes are
+/// rounded outwards, so that the decoded boxes `origin + q * 2^exponent` contain the original ones.
+/// Empty children (with a child index of 0) get inverted bounds, and the child indices are kept.
+template <size_t N, typename QNode, typename Node>
+void quantize_bvh_node(const Node& node, QNode& qnode) {
+    auto decode = [] (float origin, int e, int q) { return origin + float(q) * std::ldexp(1.0f, e); };
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for (size_t j = 0; j < N; ++j) {
+            if (node.child[j] == 0) continue;
+            lo = std::min(lo, node.bounds[axis * 2 + 0][j]);
+            hi = std::max(hi, node.bounds[axis * 2 + 1][j]);
+        }
+
+        // Smallest (normalized) cell size such that the grid covers the node
+        int e = -126;
+        if (hi > lo) e = std::max(e, int(std::ceil(std::log2((hi - lo) / 255.0f))));
+        while (e < 127 && decode(lo, e, 255) < hi) e++;
+
+        qnode.origin[axis] = lo;
+        qnode.exponent[axis] = e;
+        for (size_t j = 0; j < N; ++j) {
+            int qlo = 255, qhi = 0;
+            if (node.child[j] != 0) {
+                auto scale = std::ldexp(1.0f, -e);
+                qlo = std::min(std::max(int(std::floor((node.bounds[axis * 2 + 0][j] - lo) * scale)), 0), 255);
+                qhi = std::min(std::max(int(std::ceil ((node.bounds[axis * 2 + 1][j] - lo) * scale)), 0), 255);
+                // Correct the rounding errors of the subtractions
+                while (qlo > 0   && decode(lo, e, qlo) > node.bounds[axis * 2 + 0][j]) qlo--;
+                while (qhi < 255 && decode(lo, e, qhi) < node.bounds[axis * 2 + 1][j]) qhi++;
+            }
+            qnode.bounds[axis * 2 + 0][j] = qlo;
+            qnode.bounds[axis * 2 + 1][j] = qhi;
+        }
+    }
+    qnode.exponent[3] = 0;
+    for (size_t j = 0; j < N; ++j)
+        qnode.child[j] = node.child[j];
+}
+
 #endif // BVH_H
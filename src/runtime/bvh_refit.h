@@ -0,0 +1,227 @@
+#ifndef BVH_REFIT_H
+#define BVH_REFIT_H
+
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+#include "float3.h"
+#include "bbox.h"
+
+// Refitting works on the BVH layouts of the traversal code (Node2/Tri1, Node4/Tri4 and Node8/Tri4):
+// leaves are encoded in the nodes as ~(index of their first triangle packet), empty children of wide
+// nodes have a child index of 0, and each triangle refers to the mesh by its primitive index, the
+// index of the triangle in the mesh (4 indices per triangle: 3 vertices and the material).
+
+namespace detail {
+
+// Binary nodes store lo_x, hi_x, lo_y, hi_y, lo_z, hi_z for each child
+template <size_t K>
+inline BBox load_child_bbox(const float (&bounds)[K], size_t c) {
+    return BBox(float3(bounds[c * 6 + 0], bounds[c * 6 + 2], bounds[c * 6 + 4]),
+                float3(bounds[c * 6 + 1], bounds[c * 6 + 3], bounds[c * 6 + 5]));
+}
+
+template <size_t K>
+inline void store_child_bbox(float (&bounds)[K], size_t c, const BBox& bbox) {
+    bounds[c * 6 + 0] = bbox.min.x;
+    bounds[c * 6 + 1] = bbox.max.x;
+    bounds[c * 6 + 2] = bbox.min.y;
+    bounds[c * 6 + 3] = bbox.max.y;
+    bounds[c * 6 + 4] = bbox.min.z;
+    bounds[c * 6 + 5] = bbox.max.z;
+}
+
+// Wide nodes store one row per bound, with one column per child
+template <size_t N>
+inline BBox load_child_bbox(const float (&bounds)[6][N], size_t c) {
+    return BBox(float3(bounds[0][c], bounds[2][c], bounds[4][c]),
+                float3(bounds[1][c], bounds[3][c], bounds[5][c]));
+}
+
+template <size_t N>
+inline void store_child_bbox(float (&bounds)[6][N], size_t c, const BBox& bbox) {
+    bounds[0][c] = bbox.min.x;
+    bounds[1][c] = bbox.max.x;
+    bounds[2][c] = bbox.min.y;
+    bounds[3][c] = bbox.max.y;
+    bounds[4][c] = bbox.min.z;
+    bounds[5][c] = bbox.max.z;
+}
+
+inline void load_tri(const float3* vertices, const uint32_t* indices, uint32_t prim_id, float3& v0, float3& v1, float3& v2) {
+    v0 = vertices[indices[prim_id * 4 + 0]];
+    v1 = vertices[indices[prim_id * 4 + 1]];
+    v2 = vertices[indices[prim_id * 4 + 2]];
+}
+
+// Single triangles: the last triangle of a leaf has the sign bit of its primitive index set
+template <typename Tri, typename F>
+inline auto for_each_prim(const Tri& tri, F f) -> decltype(void(tri.v0[0] * 1.0f), bool()) {
+    f(0, uint32_t(tri.prim_id) & 0x7FFFFFFF);
+    return tri.prim_id < 0;
+}
+
+template <typename Tri>
+inline auto refit_tri(Tri& tri, const float3* vertices, const uint32_t* indices) -> decltype(void(tri.v0[0] * 1.0f)) {
+    for_each_prim(tri, [&] (size_t, uint32_t prim_id) {
+        float3 v0, v1, v2;
+        load_tri(vertices, indices, prim_id, v0, v1, v2);
+        auto e1 = v0 - v1;
+        auto e2 = v2 - v0;
+        for (int k = 0; k < 3; ++k) {
+            tri.v0[k] = v0[k];
+            tri.e1[k] = e1[k];
+            tri.e2[k] = e2[k];
+        }
+    });
+}
+
+// Packets of triangles: unused lanes have a primitive index of -1, and the last packet
+// of a leaf has the sign bit set in the primitive index of its last lane
+template <typename Tri, typename F>
+inline auto for_each_prim(const Tri& tri, F f) -> decltype(void(tri.v0[0][0]), bool()) {
+    constexpr size_t M = std::extent<decltype(tri.prim_id)>::value;
+    for (size_t j = 0; j < M; ++j) {
+        if (tri.prim_id[j] != -1)
+            f(j, uint32_t(tri.prim_id[j]) & 0x7FFFFFFF);
+    }
+    return tri.prim_id[M - 1] < 0;
+}
+
+template <typename Tri>
+inline auto refit_tri(Tri& tri, const float3* vertices, const uint32_t* indices) -> decltype(void(tri.v0[0][0])) {
+    for_each_prim(tri, [&] (size_t j, uint32_t prim_id) {
+        float3 v0, v1, v2;
+        load_tri(vertices, indices, prim_id, v0, v1, v2);
+        auto e1 = v0 - v1;
+        auto e2 = v2 - v0;
+        auto n = cross(e1, e2);
+        for (int k = 0; k < 3; ++k) {
+            tri.v0[k][j] = v0[k];
+            tri.e1[k][j] = e1[k];
+            tri.e2[k][j] = e2[k];
+            tri.n [k][j] = n[k];
+        }
+    });
+}
+
+template <typename Tri, typename F>
+inline void for_each_leaf_prim(const Tri* tris, int32_t leaf, F f) {
+    for (auto tri = tris + ~leaf; !for_each_prim(*tri, f); ++tri) ;
+}
+
+} // namespace detail
+
+/// Surface area heuristic cost of a BVH, with the cost model of the builders (traversing a node costs
+/// its area, intersecting a leaf costs its area times its number of triangles), divided by the area of the root.
+/// Comparing the cost before and after a refit indicates how much the quality of the BVH has degraded.
+template <typename Node, typename Tri>
+float bvh_sah_cost(const Node* nodes, size_t num_nodes, const Tri* tris) {
+    constexpr size_t N = std::extent<decltype(Node::child)>::value;
+    if (num_nodes == 0)
+        return 0.0f;
+
+    auto root_bbox = BBox::empty();
+    for (size_t c = 0; c < N; ++c) {
+        if (nodes[0].child[c] != 0)
+            root_bbox.extend(detail::load_child_bbox(nodes[0].bounds, c));
+    }
+
+    auto cost = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, num_nodes), 0.0,
+        [&] (const tbb::blocked_range<size_t>& range, double cost) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                for (size_t c = 0; c < N; ++c) {
+                    auto child = nodes[i].child[c];
+                    if (child == 0) continue;
+                    double area = detail::load_child_bbox(nodes[i].bounds, c).half_area();
+                    if (child < 0) {
+                        size_t count = 0;
+                        detail::for_each_leaf_prim(tris, child, [&] (size_t, uint32_t) { count++; });
+                        area *= count;
+                    }
+                    cost += area;
+                }
+            }
+            return cost;
+        }, std::plus<double>());
+    return float(1.0 + cost / root_bbox.half_area());
+}
+
+/// Updates a BVH in place after the vertices of the mesh have moved, keeping its topology:
+/// the precomputed triangle data is recomputed, and the bounding boxes are recomputed bottom-up.
+/// Nodes are processed in parallel, starting from those that have no inner child: the last child
+/// of a node to be refitted then refits its parent, so that each node is processed exactly once.
+template <typename Node, typename Tri>
+void refit_bvh(Node* nodes, size_t num_nodes, Tri* tris, size_t num_tris, const float3* vertices, const uint32_t* indices) {
+    constexpr size_t N = std::extent<decltype(Node::child)>::value;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_tris), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+            detail::refit_tri(tris[i], vertices, indices);
+    });
+
+    // Parent of each node, index of the node in its parent, and number of inner children left to refit
+    std::vector<int32_t> parents(num_nodes, -1);
+    std::vector<uint8_t> slots(num_nodes, 0);
+    std::unique_ptr<std::atomic<int32_t>[]> pending(new std::atomic<int32_t>[num_nodes]);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_nodes), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            int32_t inner = 0;
+            for (size_t c = 0; c < N; ++c) {
+                auto child = nodes[i].child[c];
+                if (child > 0) {
+                    parents[child - 1] = i;
+                    slots[child - 1] = c;
+                    inner++;
+                }
+            }
+            pending[i].store(inner, std::memory_order_relaxed);
+        }
+    });
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_nodes), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            bool bottom = true;
+            for (size_t c = 0; c < N; ++c)
+                bottom &= nodes[i].child[c] <= 0;
+            if (!bottom) continue;
+
+            int32_t j = i;
+            while (true) {
+                auto& node = nodes[j];
+                auto bbox = BBox::empty();
+                for (size_t c = 0; c < N; ++c) {
+                    auto child = node.child[c];
+                    if (child < 0) {
+                        auto leaf_bbox = BBox::empty();
+                        detail::for_each_leaf_prim(tris, child, [&] (size_t, uint32_t prim_id) {
+                            float3 v0, v1, v2;
+                            detail::load_tri(vertices, indices, prim_id, v0, v1, v2);
+                            leaf_bbox.extend(v0).extend(v1).extend(v2);
+                        });
+                        detail::store_child_bbox(node.bounds, c, leaf_bbox);
+                        bbox.extend(leaf_bbox);
+                    } else if (child > 0) {
+                        bbox.extend(detail::load_child_bbox(node.bounds, c));
+                    }
+                }
+
+                auto parent = parents[j];
+                if (parent < 0) break;
+                detail::store_child_bbox(nodes[parent].bounds, slots[j], bbox);
+                // Only the last child to finish continues with the parent
+                if (pending[parent].fetch_sub(1, std::memory_order_acq_rel) != 1) break;
+                j = parent;
+            }
+        }
+    });
+}
+
+#endif // BVH_REFIT_H
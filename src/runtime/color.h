@@ -1,6 +1,8 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <algorithm>
+
 #include "float3.h"
 #include "float4.h"
 
@@ -58,4 +60,11 @@ inline rgba clamp(const rgba& val, const rgba& min, const rgba& max) {
 inline float luminance(const rgb& c) {
     return 0.2126f*c.x + 0.7152f*c.y + 0.0722f*c.z;
 }
+
+/// Converts a CIE XYZ color to linear sRGB, and clamps negative components.
+inline rgb xyz_to_srgb(const float3& c) {
+    return rgb(std::max( 3.2404542f*c.x - 1.5371385f*c.y - 0.4985314f*c.z, 0.0f),
+               std::max(-0.9692660f*c.x + 1.8760108f*c.y + 0.0415560f*c.z, 0.0f),
+               std::max( 0.0556434f*c.x - 0.2040259f*c.y + 1.0572252f*c.z, 0.0f));
+}
 #endif // COLOR_H
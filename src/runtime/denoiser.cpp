@@ -0,0 +1,140 @@
+#include <cmath>
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "denoiser.h"
+
+// Albedo components below this value are not divided out of the color
+static constexpr float min_albedo = 1.0e-3f;
+
+static inline float brightness(const float3& c) {
+    return (c.x + c.y + c.z) * (1.0f / 3.0f);
+}
+
+// Computes x^n for an integer n, by repeated squaring
+static inline float powi(float x, unsigned n) {
+    float r = 1.0f;
+    while (n) {
+        if (n & 1) r *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return r;
+}
+
+template <typename F>
+static void parallel_rows(size_t height, F f) {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, height), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t y = range.begin(); y != range.end(); ++y)
+            f(y);
+    });
+}
+
+void Denoiser::denoise(const float* color, const float* features, size_t width, size_t height, float scale, float* out) {
+    const size_t n = width * height;
+    pixels_.resize(n);
+    for (int i = 0; i < 2; ++i) {
+        illum_[i].resize(n);
+        var_[i].resize(n);
+    }
+
+    // Read the features, and divide the color by the albedo
+    parallel_rows(height, [&] (size_t y) {
+        for (size_t x = 0, i = y * width; x < width; ++x, ++i) {
+            auto f = features + i * 8;
+            auto& pixel = pixels_[i];
+            pixel.albedo = float3(f[0], f[1], f[2]) * scale;
+            for (int c = 0; c < 3; ++c)
+                pixel.albedo[c] = pixel.albedo[c] < min_albedo ? 1.0f : pixel.albedo[c];
+            auto normal = float3(f[3], f[4], f[5]);
+            auto len = length(normal);
+            pixel.normal = len > 0.0f ? normal / len : normal;
+            pixel.depth  = f[6] * scale;
+            pixel.hit    = f[7] >= 0.0f;
+            auto c = color + i * 3;
+            illum_[0][i] = float3(c[0] * scale, c[1] * scale, c[2] * scale) / pixel.albedo;
+        }
+    });
+
+    // Estimate the variance of the illumination over a 3x3 neighborhood
+    parallel_rows(height, [&] (size_t y) {
+        for (size_t x = 0, i = y * width; x < width; ++x, ++i) {
+            float sum = 0.0f, sum2 = 0.0f, count = 0.0f;
+            for (size_t qy = y > 0 ? y - 1 : 0; qy <= std::min(y + 1, height - 1); ++qy) {
+                for (size_t qx = x > 0 ? x - 1 : 0; qx <= std::min(x + 1, width - 1); ++qx) {
+                    auto j = qy * width + qx;
+                    if (pixels_[j].hit != pixels_[i].hit)
+                        continue;
+                    auto l = brightness(illum_[0][j]);
+                    sum  += l;
+                    sum2 += l * l;
+                    count += 1.0f;
+                }
+            }
+            auto mean = sum / count;
+            var_[0][i] = std::max(sum2 / count - mean * mean, 0.0f);
+        }
+    });
+
+    // A-trous passes, with a 5x5 B3-spline kernel that is spread over an increasing number of pixels
+    static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    const unsigned normal_power = unsigned(std::max(settings.sigma_normal, 0.0f));
+    int src = 0;
+    for (size_t iter = 0; iter < settings.iterations; ++iter, src = 1 - src) {
+        const int step = 1 << iter;
+        auto& in_illum  = illum_[src];
+        auto& in_var    = var_[src];
+        auto& out_illum = illum_[1 - src];
+        auto& out_var   = var_[1 - src];
+        parallel_rows(height, [&] (size_t y) {
+            for (size_t x = 0, i = y * width; x < width; ++x, ++i) {
+                auto& p = pixels_[i];
+                auto l_p = brightness(in_illum[i]);
+                auto inv_sigma_l = 1.0f / (settings.sigma_color * std::sqrt(in_var[i]) + 1.0e-6f);
+                auto inv_sigma_z = 1.0f / (settings.sigma_depth * p.depth * step + 1.0e-6f);
+
+                float3 sum_illum(0.0f);
+                float sum_var = 0.0f, sum_w = 0.0f;
+                for (int ky = 0; ky < 5; ++ky) {
+                    int qy = int(y) + (ky - 2) * step;
+                    if (qy < 0 || qy >= int(height)) continue;
+                    for (int kx = 0; kx < 5; ++kx) {
+                        int qx = int(x) + (kx - 2) * step;
+                        if (qx < 0 || qx >= int(width)) continue;
+                        auto j = size_t(qy) * width + size_t(qx);
+                        auto& q = pixels_[j];
+                        if (q.hit != p.hit) continue;
+
+                        auto w = kernel[kx] * kernel[ky];
+                        auto e = std::abs(l_p - brightness(in_illum[j])) * inv_sigma_l;
+                        if (p.hit) {
+                            w *= powi(std::max(dot(p.normal, q.normal), 0.0f), normal_power);
+                            e += std::abs(p.depth - q.depth) * inv_sigma_z;
+                        }
+                        w *= std::exp(-e);
+
+                        sum_illum += in_illum[j] * w;
+                        sum_var   += in_var[j] * w * w;
+                        sum_w     += w;
+                    }
+                }
+
+                // The weight of the center pixel is never zero
+                out_illum[i] = sum_illum / sum_w;
+                out_var[i]   = sum_var / (sum_w * sum_w);
+            }
+        });
+    }
+
+    // Multiply the filtered illumination by the albedo
+    parallel_rows(height, [&] (size_t y) {
+        for (size_t x = 0, i = y * width; x < width; ++x, ++i) {
+            auto c = illum_[src][i] * pixels_[i].albedo;
+            out[i * 3 + 0] = c.x;
+            out[i * 3 + 1] = c.y;
+            out[i * 3 + 2] = c.z;
+        }
+    });
+}
@@ -0,0 +1,46 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <vector>
+#include <cstddef>
+
+#include "float3.h"
+
+/// Parameters of the edge-stopping functions of the denoiser.
+struct DenoiserSettings {
+    size_t iterations   = 5;        // Number of a-trous passes (the filter covers 4 * 2^iterations pixels)
+    float sigma_color   = 4.0f;     // Tolerance on the luminance, in standard deviations of the noise
+    float sigma_normal  = 128.0f;   // Exponent applied to the cosine between two normals (rounded down to an integer)
+    float sigma_depth   = 0.05f;    // Tolerance on the depth, relative to the depth of the center pixel
+};
+
+/// Edge-avoiding a-trous wavelet filter, after "Edge-Avoiding A-Trous Wavelet Transform for fast
+/// Global Illumination Filtering" (Dammertz et al.), with the variance-guided luminance weights of
+/// "Spatiotemporal Variance-Guided Filtering" (Schied et al.), without the temporal part.
+/// The filter is guided by the albedo, normal and depth of the first hit of the paths, and filters
+/// the illumination (the color divided by the albedo), so that textures are preserved.
+class Denoiser {
+public:
+    /// Filters an image of the given size. Both inputs are multiplied by `scale` when read.
+    /// - color:    3 floats per pixel, in any linear color space,
+    /// - features: 8 floats per pixel: albedo (same color space as the color), normal,
+    ///             depth, and geometry id (negative when the path did not hit anything).
+    /// The result, in the color space of the input, is written to `out` (3 floats per pixel).
+    void denoise(const float* color, const float* features, size_t width, size_t height, float scale, float* out);
+
+    DenoiserSettings settings;
+
+private:
+    struct Pixel {
+        float3 albedo;
+        float3 normal;
+        float depth;
+        bool hit;
+    };
+
+    std::vector<Pixel> pixels_;
+    std::vector<float3> illum_[2];
+    std::vector<float> var_[2];
+};
+
+#endif // DENOISER_H
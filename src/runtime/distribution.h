@@ -0,0 +1,63 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/// Entry of an alias table, laid out so that it can be loaded as a vector of 4 floats.
+struct AliasEntry {
+    float q;        // Probability to keep this entry instead of using its alias
+    int32_t alias;  // Index of the alias
+    float pdf;      // Probability to pick this entry
+    float pad;
+};
+
+/// Builds an alias table (Vose's method) for the given, non-negative weights.
+/// Falls back to a uniform distribution when all weights are zero.
+inline std::vector<AliasEntry> build_alias_table(const std::vector<float>& weights) {
+    const size_t n = weights.size();
+    std::vector<AliasEntry> table(n);
+    if (n == 0)
+        return table;
+
+    double sum = 0;
+    for (auto w : weights)
+        sum += w;
+
+    std::vector<double> scaled(n);
+    std::vector<size_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        double p = sum > 0 ? weights[i] / sum : 1.0 / n;
+        table[i].pdf = p;
+        table[i].alias = i;
+        table[i].pad = 0;
+        scaled[i] = p * n;
+        if (scaled[i] < 1.0)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back();
+        auto l = large.back();
+        small.pop_back();
+        table[s].q = scaled[s];
+        table[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Remaining entries only differ from 1 because of rounding errors
+    for (auto i : large)
+        table[i].q = 1.0f;
+    for (auto i : small)
+        table[i].q = 1.0f;
+    return table;
+}
+
+#endif // DISTRIBUTION_H
@@ -2,6 +2,8 @@
 #define IMAGE_H
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "file_path.h"
 
@@ -10,6 +12,14 @@ struct ImageRgba32 {
     size_t width, height;
 };
 
+/// Channel of an EXR image, read from interleaved pixel data.
+/// Layers are stored as channel name prefixes (e.g. "albedo.R").
+struct ExrChannel {
+    std::string name;
+    const float* data;  // Value of the channel for the first pixel
+    size_t stride;      // Distance between the values of two consecutive pixels, in floats
+};
+
 void gamma_correct(ImageRgba32&);
 
 bool load_png(const FilePath&, ImageRgba32&);
@@ -18,5 +28,6 @@ bool load_exr(const FilePath&, ImageRgba32&);
 
 bool save_png(const FilePath&, const ImageRgba32&);
 bool save_exr(const FilePath&, const ImageRgba32&, bool specialColorSpace = false);
+bool save_exr(const FilePath&, size_t width, size_t height, std::vector<ExrChannel> channels);
 
 #endif // IMAGE_H
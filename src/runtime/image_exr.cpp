@@ -1,5 +1,7 @@
 #include <fstream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include "image.h"
 #include "common.h"
@@ -30,47 +32,50 @@ bool load_exr(const FilePath& path, ImageRgba32& img) {
 }
 
 bool save_exr(const FilePath& path, const ImageRgba32& img, bool specialColorSpace) {
+    if(specialColorSpace) {
+        // TODO
+    }
+
+    return save_exr(path, img.width, img.height, {
+        ExrChannel { "R", img.pixels.get() + 0, 4 },
+        ExrChannel { "G", img.pixels.get() + 1, 4 },
+        ExrChannel { "B", img.pixels.get() + 2, 4 },
+        ExrChannel { "A", img.pixels.get() + 3, 4 }
+    });
+}
+
+bool save_exr(const FilePath& path, size_t width, size_t height, std::vector<ExrChannel> channels) {
+    // Most EXR viewers expect the channels to be sorted by name (e.g. ABGR order)
+    std::sort(channels.begin(), channels.end(), [] (const ExrChannel& a, const ExrChannel& b) {
+        return a.name < b.name;
+    });
+
     EXRHeader header;
     InitEXRHeader(&header);
 
     EXRImage image;
     InitEXRImage(&image);
 
-    image.num_channels = 4;
+    image.num_channels = channels.size();
 
-    std::vector<float> images[4];
-    images[0].resize(img.width * img.height);
-    images[1].resize(img.width * img.height);
-    images[2].resize(img.width * img.height);
-    images[3].resize(img.width * img.height);
-
-    for (int i = 0; i < img.width * img.height; i++) {
-        images[0][i] = img.pixels[4*i+0];
-        images[1][i] = img.pixels[4*i+1];
-        images[2][i] = img.pixels[4*i+2];
-        images[3][i] = img.pixels[4*i+3];
+    std::vector<std::vector<float>> images(channels.size());
+    std::vector<float*> image_ptr(channels.size());
+    for (size_t c = 0; c < channels.size(); c++) {
+        images[c].resize(width * height);
+        for (size_t i = 0; i < width * height; i++)
+            images[c][i] = channels[c].data[i * channels[c].stride];
+        image_ptr[c] = images[c].data();
     }
 
-    float* image_ptr[3];
-    image_ptr[0] = &(images[3].at(0)); // A
-    image_ptr[1] = &(images[2].at(0)); // B
-    image_ptr[2] = &(images[1].at(0)); // G
-    image_ptr[3] = &(images[0].at(0)); // R
-
-    image.images = (unsigned char**)image_ptr;
-    image.width = img.width;
-    image.height = img.height;
+    image.images = (unsigned char**)image_ptr.data();
+    image.width = width;
+    image.height = height;
 
     header.num_channels = image.num_channels;
     header.channels = (EXRChannelInfo *)malloc(sizeof(EXRChannelInfo) * header.num_channels);
-    // Must be (A)BGR order, since most of EXR viewers expect this channel order.
-    strncpy(header.channels[0].name, "A", 255); header.channels[0].name[strlen("A")] = '\0';
-    strncpy(header.channels[1].name, "B", 255); header.channels[1].name[strlen("B")] = '\0';
-    strncpy(header.channels[2].name, "G", 255); header.channels[2].name[strlen("G")] = '\0';
-    strncpy(header.channels[3].name, "R", 255); header.channels[3].name[strlen("R")] = '\0';
-
-    if(specialColorSpace) {
-        // TODO
+    for (int i = 0; i < header.num_channels; i++) {
+        strncpy(header.channels[i].name, channels[i].name.c_str(), 255);
+        header.channels[i].name[255] = '\0';
     }
 
     header.pixel_types = (int *)malloc(sizeof(int) * header.num_channels);
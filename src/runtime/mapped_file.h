@@ -0,0 +1,92 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// Read-only view of a file, mapped in memory.
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const std::string& file_name) { open(file_name); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) { swap(other); }
+    MappedFile& operator = (MappedFile&& other) { swap(other); return *this; }
+
+    /// Maps the given file in memory. Returns false if the file cannot be mapped.
+    bool open(const std::string& file_name) {
+        close();
+#ifdef _WIN32
+        auto file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) {
+                data_ = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                size_ = data_ ? size_t(size.QuadPart) : 0;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            auto ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                data_ = (const char*)ptr;
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+#endif
+        return data_ != nullptr;
+    }
+
+    void close() {
+        if (!data_) return;
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+#else
+        munmap((void*)data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool is_open() const { return data_ != nullptr; }
+
+private:
+    void swap(MappedFile& other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // MAPPED_FILE_H
@@ -3,9 +3,13 @@
 #include <cstring>
 #include <cstdlib>
 #include <cctype>
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
 
 #include "common.h"
 #include "obj.h"
+#include "mapped_file.h"
 
 namespace obj {
 
@@ -101,29 +105,71 @@ inline bool read_index(char** ptr, obj::Index& idx) {
     return true;
 }
 
-static bool parse_obj(std::istream& stream, obj::File& file) {
-    // Add an empty object to the scene
-    int cur_object = 0;
-    file.objects.emplace_back();
+// OBJ files are split in chunks of (at least) this size, which are parsed concurrently
+static constexpr size_t obj_chunk_size = 1 << 22;
 
-    // Add an empty group to this object
-    int cur_group = 0;
-    file.objects[0].groups.emplace_back();
+struct ObjCommand {
+    enum Type { Group, Object, UseMtl };
+    Type type;
+    size_t face;            // Number of faces of the chunk that come before this command
+    std::string name;       // Material name, for UseMtl
+};
 
-    // Add an empty material to the scene
-    int cur_mtl = 0;
-    file.materials.emplace_back("");
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+    size_t num_lines     = 0, first_line      = 0;
+    size_t num_vertices  = 0, vertex_offset   = 0;
+    size_t num_normals   = 0, normal_offset   = 0;
+    size_t num_texcoords = 0, texcoord_offset = 0;
+    std::vector<obj::Face>   faces;
+    std::vector<ObjCommand>  commands;
+    std::vector<std::string> mtl_libs;
+    int err_count = 0;
+};
 
-    // Add dummy vertex, normal, and texcoord
-    file.vertices.emplace_back();
-    file.normals.emplace_back();
-    file.texcoords.emplace_back();
+// Calls the given function on every line of the range, with a null-terminated copy of the line (of any length)
+template <typename F>
+static void for_each_line(const char* begin, const char* end, F f) {
+    std::string line;
+    while (begin < end) {
+        auto eol = (const char*)std::memchr(begin, '\n', end - begin);
+        if (!eol) eol = end;
+        line.assign(begin, eol);
+        f(&line[0]);
+        begin = eol + 1;
+    }
+}
 
-    int err_count = 0, cur_line = 0;
-    const int max_line = 1024;
-    char line[max_line];
+// First pass: counts the number of lines, vertices, normals and texture coordinates in a chunk
+static void count_obj_chunk(ObjChunk& chunk) {
+    bool line_start = true;
+    for (const char* ptr = chunk.begin; ptr < chunk.end; ++ptr) {
+        if (*ptr == '\n') {
+            chunk.num_lines++;
+            line_start = true;
+        } else if (line_start && !std::isspace(*ptr)) {
+            line_start = false;
+            if (*ptr != 'v' || ptr + 1 == chunk.end) continue;
+            switch (ptr[1]) {
+                case ' ':
+                case '\t': chunk.num_vertices++;  break;
+                case 'n':  chunk.num_normals++;   break;
+                case 't':  chunk.num_texcoords++; break;
+                default:   break;
+            }
+        }
+    }
+}
+
+// Second pass: parses a chunk, once the position of its vertices, normals and texture coordinates in the file is known
+static void parse_obj_chunk(ObjChunk& chunk, obj::File& file) {
+    size_t cur_line = chunk.first_line;
+    size_t cur_vertex   = chunk.vertex_offset;
+    size_t cur_normal   = chunk.normal_offset;
+    size_t cur_texcoord = chunk.texcoord_offset;
 
-    while (stream.getline(line, max_line)) {
+    for_each_line(chunk.begin, chunk.end, [&] (char* line) {
         cur_line++;
 
         // Strip spaces
@@ -131,7 +177,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
 
         // Skip comments and empty lines
         if (*ptr == '\0' || *ptr == '#')
-            continue;
+            return;
 
         remove_eol(ptr);
 
@@ -145,7 +191,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         v.x = std::strtof(ptr + 1, &ptr);
                         v.y = std::strtof(ptr, &ptr);
                         v.z = std::strtof(ptr, &ptr);
-                        file.vertices.push_back(v);
+                        file.vertices[cur_vertex++] = v;
                     }
                     break;
                 case 'n':
@@ -154,7 +200,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         n.x = std::strtof(ptr + 2, &ptr);
                         n.y = std::strtof(ptr, &ptr);
                         n.z = std::strtof(ptr, &ptr);
-                        file.normals.push_back(n);
+                        file.normals[cur_normal++] = n;
                     }
                     break;
                 case 't':
@@ -162,18 +208,19 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         float2 t;
                         t.x = std::strtof(ptr + 2, &ptr);
                         t.y = std::strtof(ptr, &ptr);
-                        file.texcoords.push_back(t);
+                        file.texcoords[cur_texcoord++] = t;
                     }
                     break;
                 default:
                     error("Invalid vertex (line ", cur_line, ").");
-                    err_count++;
+                    chunk.err_count++;
                     break;
             }
         } else if (*ptr == 'f' && std::isspace(ptr[1])) {
             obj::Face f;
 
-            f.material = cur_mtl;
+            // The material is set when the chunks are merged
+            f.material = 0;
 
             bool valid = true;
             ptr += 2;
@@ -186,13 +233,13 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
 
             if (f.indices.size() < 3) {
                 error("Invalid face (line ", cur_line, ").");
-                err_count++;
+                chunk.err_count++;
             } else {
                 // Convert relative indices to absolute
                 for (size_t i = 0; i < f.indices.size(); i++) {
-                    f.indices[i].v = (f.indices[i].v < 0) ? file.vertices.size()  + f.indices[i].v : f.indices[i].v;
-                    f.indices[i].t = (f.indices[i].t < 0) ? file.texcoords.size() + f.indices[i].t : f.indices[i].t;
-                    f.indices[i].n = (f.indices[i].n < 0) ? file.normals.size()   + f.indices[i].n : f.indices[i].n;
+                    f.indices[i].v = (f.indices[i].v < 0) ? cur_vertex   + f.indices[i].v : f.indices[i].v;
+                    f.indices[i].t = (f.indices[i].t < 0) ? cur_texcoord + f.indices[i].t : f.indices[i].t;
+                    f.indices[i].n = (f.indices[i].n < 0) ? cur_normal   + f.indices[i].n : f.indices[i].n;
                 }
 
                 // Check if the indices are valid or not
@@ -205,21 +252,16 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                 }
 
                 if (valid) {
-                    file.objects[cur_object].groups[cur_group].faces.push_back(f);
+                    chunk.faces.push_back(std::move(f));
                 } else {
                     error("Invalid indices in face definition (line ", cur_line, ").");
-                    err_count++;
+                    chunk.err_count++;
                 }
             }
         } else if (*ptr == 'g' && std::isspace(ptr[1])) {
-            file.objects[cur_object].groups.emplace_back();
-            cur_group++;
+            chunk.commands.push_back(ObjCommand { ObjCommand::Group, chunk.faces.size(), "" });
         } else if (*ptr == 'o' && std::isspace(ptr[1])) {
-            file.objects.emplace_back();
-            cur_object++;
-
-            file.objects[cur_object].groups.emplace_back();
-            cur_group = 0;
+            chunk.commands.push_back(ObjCommand { ObjCommand::Object, chunk.faces.size(), "" });
         } else if (!std::strncmp(ptr, "usemtl", 6) && std::isspace(ptr[6])) {
             ptr += 6;
 
@@ -227,12 +269,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
             char* base = ptr;
             ptr = strip_text(ptr);
 
-            const std::string mtl_name(base, ptr);
-
-            cur_mtl = std::find(file.materials.begin(), file.materials.end(), mtl_name) - file.materials.begin();
-            if (cur_mtl == (int)file.materials.size()) {
-                file.materials.push_back(mtl_name);
-            }
+            chunk.commands.push_back(ObjCommand { ObjCommand::UseMtl, chunk.faces.size(), std::string(base, ptr) });
         } else if (!std::strncmp(ptr, "mtllib", 6) && std::isspace(ptr[6])) {
             ptr += 6;
 
@@ -240,37 +277,127 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
             char* base = ptr;
             ptr = strip_text(ptr);
 
-            const std::string lib_name(base, ptr);
-
-            file.mtl_libs.push_back(lib_name);
+            chunk.mtl_libs.emplace_back(base, ptr);
         } else if (*ptr == 's' && std::isspace(ptr[1])) {
             // Ignore smooth commands
         } else if (*ptr == 'l' && std::isspace(ptr[1])) {
             // Ignore polyline commands
         } else {
             error("Unknown command '", ptr, "' (line ", cur_line, ").");
-            err_count++;
+            chunk.err_count++;
+        }
+    });
+}
+
+static bool parse_obj(const char* data, size_t size, obj::File& file) {
+    // Split the file in chunks, on line boundaries
+    std::vector<ObjChunk> chunks;
+    const char* end = data + size;
+    for (const char* ptr = data; ptr < end;) {
+        const char* next = end;
+        if (size_t(end - ptr) > obj_chunk_size) {
+            next = (const char*)std::memchr(ptr + obj_chunk_size, '\n', end - ptr - obj_chunk_size);
+            next = next ? next + 1 : end;
         }
+        ObjChunk chunk;
+        chunk.begin = ptr;
+        chunk.end = next;
+        chunks.push_back(std::move(chunk));
+        ptr = next;
+    }
+
+    tbb::parallel_for(size_t(0), chunks.size(), [&] (size_t i) {
+        count_obj_chunk(chunks[i]);
+    });
+
+    // Compute the offset of each chunk in the file, after the dummy vertex, normal, and texcoord
+    size_t num_vertices = 1, num_normals = 1, num_texcoords = 1, num_lines = 0;
+    for (auto& chunk : chunks) {
+        chunk.first_line      = num_lines;
+        chunk.vertex_offset   = num_vertices;
+        chunk.normal_offset   = num_normals;
+        chunk.texcoord_offset = num_texcoords;
+        num_vertices  += chunk.num_vertices;
+        num_normals   += chunk.num_normals;
+        num_texcoords += chunk.num_texcoords;
+        num_lines     += chunk.num_lines;
+    }
+
+    file.vertices.resize(num_vertices);
+    file.normals.resize(num_normals);
+    file.texcoords.resize(num_texcoords);
+    file.vertices[0]  = float3(0.0f);
+    file.normals[0]   = float3(0.0f);
+    file.texcoords[0] = float2(0.0f);
+    tbb::parallel_for(size_t(0), chunks.size(), [&] (size_t i) {
+        parse_obj_chunk(chunks[i], file);
+    });
+
+    // Add an empty object to the scene
+    int cur_object = 0;
+    file.objects.emplace_back();
+
+    // Add an empty group to this object
+    int cur_group = 0;
+    file.objects[0].groups.emplace_back();
+
+    // Add an empty material to the scene
+    int cur_mtl = 0;
+    file.materials.emplace_back("");
+
+    // Merge the chunks in order, replaying the commands that change the current object, group, or material
+    int err_count = 0;
+    for (auto& chunk : chunks) {
+        size_t cur_face = 0;
+        auto add_faces = [&] (size_t end) {
+            auto& faces = file.objects[cur_object].groups[cur_group].faces;
+            for (; cur_face < end; ++cur_face) {
+                chunk.faces[cur_face].material = cur_mtl;
+                faces.push_back(std::move(chunk.faces[cur_face]));
+            }
+        };
+
+        for (auto& command : chunk.commands) {
+            add_faces(command.face);
+            if (command.type == ObjCommand::Group) {
+                file.objects[cur_object].groups.emplace_back();
+                cur_group++;
+            } else if (command.type == ObjCommand::Object) {
+                file.objects.emplace_back();
+                cur_object++;
+
+                file.objects[cur_object].groups.emplace_back();
+                cur_group = 0;
+            } else {
+                cur_mtl = std::find(file.materials.begin(), file.materials.end(), command.name) - file.materials.begin();
+                if (cur_mtl == (int)file.materials.size()) {
+                    file.materials.push_back(command.name);
+                }
+            }
+        }
+        add_faces(chunk.faces.size());
+
+        file.mtl_libs.insert(file.mtl_libs.end(), chunk.mtl_libs.begin(), chunk.mtl_libs.end());
+        err_count += chunk.err_count;
     }
 
     return (err_count == 0);
 }
 
 static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
-    const int max_line = 1024;
     int err_count = 0, cur_line = 0;
-    char line[max_line];
+    std::string buffer;
 
     std::string mtl_name;
     auto current_material = [&] () -> obj::Material& {
         return mtl_lib[mtl_name];
     };
 
-    while (stream.getline(line, max_line)) {
+    while (std::getline(stream, buffer)) {
         cur_line++;
 
         // Strip spaces
-        char* ptr = strip_spaces(line);
+        char* ptr = strip_spaces(&buffer[0]);
 
         // Skip comments and empty lines
         if (*ptr == '\0' || *ptr == '#')
@@ -373,9 +500,11 @@ static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
 }
 
 bool load_obj(const FilePath& path, obj::File& obj_file) {
-    // Parse the OBJ file
-    std::ifstream stream(path);
-    return stream && parse_obj(stream, obj_file);
+    // Parse the OBJ file in place (empty files cannot be mapped, but are still valid)
+    MappedFile file;
+    if (!file.open(path) && !std::ifstream(path))
+        return false;
+    return parse_obj(file.is_open() ? file.data() : "", file.size(), obj_file);
 }
 
 bool load_mtl(const FilePath& path, obj::MaterialLib& mtl_lib) {
@@ -384,48 +513,62 @@ bool load_mtl(const FilePath& path, obj::MaterialLib& mtl_lib) {
     return stream && parse_mtl(stream, mtl_lib);
 }
 
-mesh::TriMesh compute_tri_mesh(const File& obj_file, size_t mtl_offset) {
-    mesh::TriMesh tri_mesh;
+// Triangles of an object, along with the list of unique vertices they reference
+struct ObjTriangles {
+    std::vector<TriIdx> triangles;
+    std::vector<obj::Index> vertices;
+    bool has_normals = false;
+    bool has_texcoords = false;
+};
 
-    for (auto& obj: obj_file.objects) {
-        // Convert the faces to triangles & build the new list of indices
-        std::vector<TriIdx> triangles;
-        std::unordered_map<obj::Index, size_t, HashIndex, CompareIndex> mapping;
-
-        bool has_normals = false;
-        bool has_texcoords = false;
-        for (auto& group : obj.groups) {
-            for (auto& face : group.faces) {
-                for (size_t i = 0; i < face.indices.size(); i++) {
-                    auto map = mapping.find(face.indices[i]);
-                    if (map == mapping.end()) {
-                        has_normals |= (face.indices[i].n != 0);
-                        has_texcoords |= (face.indices[i].t != 0);
-
-                        mapping.insert(std::make_pair(face.indices[i], mapping.size()));
-                    }
+static void compute_obj_triangles(const obj::Object& obj, size_t mtl_offset, ObjTriangles& result) {
+    // Convert the faces to triangles & build the new list of indices
+    std::unordered_map<obj::Index, size_t, HashIndex, CompareIndex> mapping;
+    auto& triangles = result.triangles;
+    auto& vertices = result.vertices;
+    for (auto& group : obj.groups) {
+        for (auto& face : group.faces) {
+            size_t ids[3];
+            for (size_t i = 0; i < face.indices.size(); i++) {
+                auto it = mapping.emplace(face.indices[i], vertices.size());
+                if (it.second) {
+                    result.has_normals |= (face.indices[i].n != 0);
+                    result.has_texcoords |= (face.indices[i].t != 0);
+                    vertices.push_back(face.indices[i]);
                 }
 
-                auto v0 = mapping[face.indices[0]];
-                auto prev = mapping[face.indices[1]];
-
-                for (size_t i = 1; i < face.indices.size() - 1; i++) {
-                    auto next = mapping[face.indices[i + 1]];
-                    triangles.emplace_back(v0, prev, next, face.material + mtl_offset);
-                    prev = next;
+                // Triangulate the face as a fan around the first vertex
+                ids[std::min(i, size_t(2))] = it.first->second;
+                if (i >= 2) {
+                    triangles.emplace_back(ids[0], ids[1], ids[2], face.material + mtl_offset);
+                    ids[1] = ids[2];
                 }
             }
         }
+    }
+}
+
+mesh::TriMesh compute_tri_mesh(const File& obj_file, size_t mtl_offset) {
+    mesh::TriMesh tri_mesh;
+
+    // Objects are triangulated in parallel, and then added to the mesh in order
+    std::vector<ObjTriangles> objects(obj_file.objects.size());
+    tbb::parallel_for(size_t(0), objects.size(), [&] (size_t i) {
+        compute_obj_triangles(obj_file.objects[i], mtl_offset, objects[i]);
+    });
 
+    for (auto& object : objects) {
+        auto& triangles = object.triangles;
+        auto& vertices = object.vertices;
         if (triangles.size() == 0) continue;
 
         // Add this object to the mesh
         auto vtx_offset = tri_mesh.vertices.size();
         auto idx_offset = tri_mesh.indices.size();
         tri_mesh.indices.resize(idx_offset + 4 * triangles.size());
-        tri_mesh.vertices.resize(vtx_offset + mapping.size());
-        tri_mesh.texcoords.resize(vtx_offset + mapping.size());
-        tri_mesh.normals.resize(vtx_offset + mapping.size());
+        tri_mesh.vertices.resize(vtx_offset + vertices.size());
+        tri_mesh.texcoords.resize(vtx_offset + vertices.size());
+        tri_mesh.normals.resize(vtx_offset + vertices.size());
 
         for (size_t i = 0, n = triangles.size(); i < n; i++) {
             auto& t = triangles[i];
@@ -435,13 +578,13 @@ mesh::TriMesh compute_tri_mesh(const File& obj_file, size_t mtl_offset) {
             tri_mesh.indices[idx_offset + i * 4 + 3] = t.m;
         }
 
-        for (auto& p : mapping) {
-            tri_mesh.vertices[vtx_offset + p.second] = obj_file.vertices[p.first.v];
+        for (size_t i = 0; i < vertices.size(); i++) {
+            tri_mesh.vertices[vtx_offset + i] = obj_file.vertices[vertices[i].v];
         }
 
-        if (has_texcoords) {
-            for (auto& p : mapping) {
-                tri_mesh.texcoords[vtx_offset + p.second] = obj_file.texcoords[p.first.t];
+        if (object.has_texcoords) {
+            for (size_t i = 0; i < vertices.size(); i++) {
+                tri_mesh.texcoords[vtx_offset + i] = obj_file.texcoords[vertices[i].t];
             }
         } else {
             warn("No texture coordinates are present, using default value.");
@@ -453,11 +596,10 @@ mesh::TriMesh compute_tri_mesh(const File& obj_file, size_t mtl_offset) {
         tri_mesh.face_area.resize(tri_mesh.face_area.size() + triangles.size());
         mesh::compute_face_normals(tri_mesh.indices, tri_mesh.vertices, tri_mesh.face_normals, tri_mesh.face_area, idx_offset);
 
-        if (has_normals) {
+        if (object.has_normals) {
             // Set up mesh normals
-            for (auto& p : mapping) {
-                const auto& n = obj_file.normals[p.first.n];
-                tri_mesh.normals[vtx_offset + p.second] = n;
+            for (size_t i = 0; i < vertices.size(); i++) {
+                tri_mesh.normals[vtx_offset + i] = obj_file.normals[vertices[i].n];
             }
         } else {
             // Recompute normals
@@ -0,0 +1,168 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
+#include <x86intrin.h>
+#endif
+
+#include <anydsl_runtime.hpp>
+
+#include "tonemap.h"
+
+typedef void (*TonemapFn)(float*, float*, float*, int32_t, int32_t);
+
+struct Method {
+    const char* name;
+    TonemapFn fn;
+    float max_error;        // Maximum absolute error on one sample, against the table
+    float max_rel_error;    // Maximum relative error on the integrated spectra, against the table
+};
+
+static const float wvl_min = 360.0f;
+static const float wvl_max = 830.0f;
+
+int64_t clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+// Hero wavelength sampling: the secondary wavelengths are equally spaced and wrap around the range
+static void stratify(float hero, float* wvls, size_t i, size_t n) {
+    auto delta = (wvl_max - wvl_min) / 4.0f;
+    for (size_t k = 0; k < 4; ++k) {
+        auto w = hero + k * delta;
+        wvls[k * n + i] = w >= wvl_max ? w - (wvl_max - wvl_min) : w;
+    }
+}
+
+// Integrates a spectrum, given as a function of the wavelength, over the visible range
+template <typename F>
+static void integrate(TonemapFn fn, F spectrum, size_t n, double* xyz) {
+    std::vector<float> wvls(4 * n), weights(4 * n), out(3 * n);
+    for (size_t i = 0; i < n; ++i) {
+        stratify(wvl_min + (i + 0.5f) * (wvl_max - wvl_min) / (4 * n), wvls.data(), i, n);
+        for (size_t k = 0; k < 4; ++k)
+            weights[k * n + i] = spectrum(wvls[k * n + i]);
+    }
+    fn(wvls.data(), weights.data(), out.data(), n, 1);
+    for (size_t c = 0; c < 3; ++c) {
+        xyz[c] = 0;
+        for (size_t i = 0; i < n; ++i)
+            xyz[c] += out[c * n + i];
+        xyz[c] /= n;
+    }
+}
+
+static void usage() {
+    std::cout << "Usage: bench_tonemap [options]\n"
+              << "Available options:\n"
+              << "   --check           Only checks the accuracy of the methods against the tabulated functions\n"
+              << "   -n       samples  Number of samples per iteration (default: 65536)\n"
+              << "   --iters  count    Number of iterations per measurement (default: 100)\n"
+              << "   --bench  count    Number of measurements, of which the median is reported (default: 10)\n"
+              << std::flush;
+}
+
+int main(int argc, char** argv) {
+#if defined(__x86_64__) || defined(__amd64__) || defined(_M_X64)
+    _mm_setcsr(_mm_getcsr() | (_MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON));
+#endif
+
+    bool check_only = false;
+    size_t n = 65536;
+    size_t num_iters = 100;
+    size_t num_bench = 10;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--check")) {
+            check_only = true;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            n = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--iters") && i + 1 < argc) {
+            num_iters = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            num_bench = strtoul(argv[++i], nullptr, 10);
+        } else {
+            usage();
+            return argv[i][0] == '-' && argv[i][1] == 'h' ? 0 : 1;
+        }
+    }
+    if (n == 0 || num_iters == 0 || num_bench == 0) {
+        usage();
+        return 1;
+    }
+
+    const Method methods[] = {
+        { "table", cpu_tonemap_table, 0.0f,    0.0f },
+        { "lut",   cpu_tonemap_lut,   1.0e-5f, 1.0e-5f },
+        { "fit",   cpu_tonemap_fit,   0.05f,   0.01f }
+    };
+
+    // Random wavelengths and weights, some of them zero to exercise the compensation
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> rnd(0.0f, 1.0f);
+    std::vector<float> wvls(4 * n), weights(4 * n);
+    for (size_t i = 0; i < n; ++i) {
+        stratify(wvl_min + rnd(gen) * (wvl_max - wvl_min), wvls.data(), i, n);
+        for (size_t k = 0; k < 4; ++k)
+            weights[k * n + i] = rnd(gen) < 0.1f ? 0.0f : rnd(gen);
+    }
+
+    std::vector<float> ref(3 * n), out(3 * n);
+    cpu_tonemap_table(wvls.data(), weights.data(), ref.data(), n, 1);
+
+    // Spectra used to check the integrated values: white, a ramp, and a narrow band
+    auto white = [] (float)   { return 1.0f; };
+    auto ramp  = [] (float w) { return (w - wvl_min) / (wvl_max - wvl_min); };
+    auto band  = [] (float w) { return std::exp(-0.5f * (w - 550.0f) * (w - 550.0f) / (20.0f * 20.0f)); };
+    double ref_white[3], ref_ramp[3], ref_band[3];
+    integrate(cpu_tonemap_table, white, n, ref_white);
+    integrate(cpu_tonemap_table, ramp,  n, ref_ramp);
+    integrate(cpu_tonemap_table, band,  n, ref_band);
+
+    bool ok = true;
+    std::cout << std::setprecision(4);
+    for (auto& method : methods) {
+        method.fn(wvls.data(), weights.data(), out.data(), n, 1);
+        float max_error = 0.0f;
+        for (size_t i = 0; i < 3 * n; ++i)
+            max_error = std::max(max_error, std::fabs(out[i] - ref[i]));
+
+        double xyz[3];
+        float max_rel_error = 0.0f;
+        auto check = [&] (const double* ref_xyz) {
+            for (size_t c = 0; c < 3; ++c)
+                max_rel_error = std::max(max_rel_error, float(std::fabs(xyz[c] - ref_xyz[c]) / ref_xyz[c]));
+        };
+        integrate(method.fn, white, n, xyz); check(ref_white);
+        integrate(method.fn, ramp,  n, xyz); check(ref_ramp);
+        integrate(method.fn, band,  n, xyz); check(ref_band);
+
+        bool passed = max_error <= method.max_error && max_rel_error <= method.max_rel_error;
+        ok &= passed;
+        std::cout << method.name << ": max. error " << max_error
+                  << ", max. relative error on integrated spectra " << max_rel_error
+                  << (passed ? "" : " (FAILED)") << std::endl;
+    }
+    if (check_only)
+        return ok ? 0 : 1;
+
+    for (auto& method : methods) {
+        std::vector<int64_t> us;
+        for (size_t i = 0; i < num_bench; ++i) {
+            auto start = clock_us();
+            method.fn(wvls.data(), weights.data(), out.data(), n, num_iters);
+            us.push_back(clock_us() - start);
+        }
+        std::sort(us.begin(), us.end());
+        auto median = std::max(us[us.size() / 2], int64_t(1));
+        std::cout << method.name << ": " << double(n * num_iters) / double(median) << " Msamples/s, "
+                  << double(median) * 1000.0 / double(n * num_iters) << " ns/sample" << std::endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -37,6 +37,7 @@ inline void usage() {
                  "  -s       --single          Uses only single rays on the CPU (incompatible with --packet, disabled by default)\n"
                  "  -p       --packet          Uses only packets of rays on the CPU (incompatible with --single, disabled by default)\n"
                  "           --bvh-width       Sets the BVH width (4 or 8, default: 4)\n"
+                 "  -q       --quantized       Uses the BVH8 with quantized bounds (requires a BVH width of 8, disabled by default)\n"
                  "           --ray-width       Sets the ray width (4 or 8, default: 8)\n"
                  "  -o       --output          Sets the output file name (no file is generated by default)\n";
 }
@@ -81,6 +82,46 @@ static double bench_cpu_single(Node8* nodes, Tri4* tris, Ray1* rays, Hit1* hits,
     return (t1 - t0) / 1000.0;
 }
 
+static double bench_cpu_hybrid(Node8Q* nodes, Tri4* tris, Ray4* rays, Hit4* hits, size_t n, bool any_hit) {
+    auto t0 = anydsl_get_micro_time();
+    if (any_hit) cpu_occluded_hybrid_ray4_bvh8q_tri4(nodes, tris, rays, hits, n);
+    else         cpu_intersect_hybrid_ray4_bvh8q_tri4(nodes, tris, rays, hits, n);
+    auto t1 = anydsl_get_micro_time();
+    return (t1 - t0) / 1000.0;
+}
+
+static double bench_cpu_packet(Node8Q* nodes, Tri4* tris, Ray4* rays, Hit4* hits, size_t n, bool any_hit) {
+    auto t0 = anydsl_get_micro_time();
+    if (any_hit) cpu_occluded_packet_ray4_bvh8q_tri4(nodes, tris, rays, hits, n);
+    else         cpu_intersect_packet_ray4_bvh8q_tri4(nodes, tris, rays, hits, n);
+    auto t1 = anydsl_get_micro_time();
+    return (t1 - t0) / 1000.0;
+}
+
+static double bench_cpu_hybrid(Node8Q* nodes, Tri4* tris, Ray8* rays, Hit8* hits, size_t n, bool any_hit) {
+    auto t0 = anydsl_get_micro_time();
+    if (any_hit) cpu_occluded_hybrid_ray8_bvh8q_tri4(nodes, tris, rays, hits, n);
+    else         cpu_intersect_hybrid_ray8_bvh8q_tri4(nodes, tris, rays, hits, n);
+    auto t1 = anydsl_get_micro_time();
+    return (t1 - t0) / 1000.0;
+}
+
+static double bench_cpu_packet(Node8Q* nodes, Tri4* tris, Ray8* rays, Hit8* hits, size_t n, bool any_hit) {
+    auto t0 = anydsl_get_micro_time();
+    if (any_hit) cpu_occluded_packet_ray8_bvh8q_tri4(nodes, tris, rays, hits, n);
+    else         cpu_intersect_packet_ray8_bvh8q_tri4(nodes, tris, rays, hits, n);
+    auto t1 = anydsl_get_micro_time();
+    return (t1 - t0) / 1000.0;
+}
+
+static double bench_cpu_single(Node8Q* nodes, Tri4* tris, Ray1* rays, Hit1* hits, size_t n, bool any_hit) {
+    auto t0 = anydsl_get_micro_time();
+    if (any_hit) cpu_occluded_single_ray1_bvh8q_tri4(nodes, tris, rays, hits, n);
+    else         cpu_intersect_single_ray1_bvh8q_tri4(nodes, tris, rays, hits, n);
+    auto t1 = anydsl_get_micro_time();
+    return (t1 - t0) / 1000.0;
+}
+
 static double bench_cpu_hybrid(Node4* nodes, Tri4* tris, Ray4* rays, Hit4* hits, size_t n, bool any_hit) {
     auto t0 = anydsl_get_micro_time();
     if (any_hit) cpu_occluded_hybrid_ray4_bvh4_tri4(nodes, tris, rays, hits, n);
@@ -147,6 +188,7 @@ int main(int argc, char** argv) {
     int bvh_width = 4;
     int ray_width = 8;
     bool single = false, packet = false;
+    bool quantized = false;
 
     for (int i = 1; i < argc; i++) {
         auto arg = argv[i];
@@ -195,6 +237,8 @@ int main(int argc, char** argv) {
             } else if (!strcmp(arg, "--bvh-width")) {
                 check_argument(i, argc, argv);
                 bvh_width = strtol(argv[++i], nullptr, 10);
+            } else if (!strcmp(arg, "-q") || !strcmp(arg, "--quantized")) {
+                quantized = true;
             }  else if (!strcmp(arg, "--ray-width")) {
                 check_argument(i, argc, argv);
                 ray_width = strtol(argv[++i], nullptr, 10);
@@ -243,10 +287,15 @@ int main(int argc, char** argv) {
         std::cerr << "Invalid ray width" << std::endl;
         return 1;
     }
+    if (quantized && (use_gpu || bvh_width != 8)) {
+        std::cerr << "Option '--quantized' requires a BVH width of 8 on the CPU" << std::endl;
+        return 1;
+    }
 
     anydsl::Array<Node2> nodes2;
     anydsl::Array<Node4> nodes4;
     anydsl::Array<Node8> nodes8;
+    anydsl::Array<Node8Q> nodes8q;
     anydsl::Array<Tri1>  tris1;
     anydsl::Array<Tri4>  tris4;
 
@@ -260,6 +309,11 @@ int main(int argc, char** argv) {
             std::cerr << "Cannot load BVH file" << std::endl;
             return 1;
         }
+    } else if (quantized) {
+        if (!load_bvh(bvh_file, nodes8q, tris4, BvhType::BVH8Q_TRI4, platform, device)) {
+            std::cerr << "Cannot load BVH file (the quantized BVH is only written by 'bvh_extractor --quantized')" << std::endl;
+            return 1;
+        }
     } else {
         if (!load_bvh(bvh_file, nodes8, tris4, BvhType::BVH8_TRI4, platform, device)) {
             std::cerr << "Cannot load BVH file" << std::endl;
@@ -267,6 +321,10 @@ int main(int argc, char** argv) {
         }
     }
 
+    size_t node_bytes = nodes2.size() * sizeof(Node2) + nodes4.size() * sizeof(Node4) +
+                        nodes8.size() * sizeof(Node8) + nodes8q.size() * sizeof(Node8Q);
+    std::cout << node_bytes / 1024 << " KB of BVH nodes." << std::endl;
+
     anydsl::Array<Ray1> rays1;
     anydsl::Array<Ray4> rays4;
     anydsl::Array<Ray8> rays8;
@@ -315,6 +373,15 @@ int main(int argc, char** argv) {
             if (ray_width == 4) bench = [&] { return bench_cpu_hybrid(nodes4.data(), tris4.data(), rays4.data(), hits4.data(), rays4.size(), any_hit); };
             else                bench = [&] { return bench_cpu_hybrid(nodes4.data(), tris4.data(), rays8.data(), hits8.data(), rays8.size(), any_hit); };
         }
+    } else if (quantized) {
+        if (single)      bench = [&] { return bench_cpu_single(nodes8q.data(), tris4.data(), rays1.data(), hits1.data(), rays1.size(), any_hit); };
+        else if (packet) {
+            if (ray_width == 4) bench = [&] { return bench_cpu_packet(nodes8q.data(), tris4.data(), rays4.data(), hits4.data(), rays4.size(), any_hit); };
+            else                bench = [&] { return bench_cpu_packet(nodes8q.data(), tris4.data(), rays8.data(), hits8.data(), rays8.size(), any_hit); };
+        } else {
+            if (ray_width == 4) bench = [&] { return bench_cpu_hybrid(nodes8q.data(), tris4.data(), rays4.data(), hits4.data(), rays4.size(), any_hit); };
+            else                bench = [&] { return bench_cpu_hybrid(nodes8q.data(), tris4.data(), rays8.data(), hits8.data(), rays8.size(), any_hit); };
+        }
     } else {
         if (single)      bench = [&] { return bench_cpu_single(nodes8.data(), tris4.data(), rays1.data(), hits1.data(), rays1.size(), any_hit); };
         else if (packet) {
@@ -3,12 +3,13 @@
 #include <vector>
 #include <cstring>
 
+#include "traversal.h"
 #include "runtime/obj.h"
 #include "runtime/file_path.h"
 #include "runtime/bvh.h"
 
 #ifdef ENABLE_EMBREE_BVH
-size_t build_bvh8(std::ofstream&, const mesh::TriMesh&);
+size_t build_bvh8(std::ofstream&, const mesh::TriMesh&, bool);
 size_t build_bvh4(std::ofstream&, const mesh::TriMesh&);
 #endif
 size_t build_bvh2(std::ofstream&, const mesh::TriMesh&);
@@ -24,11 +25,13 @@ inline void usage() {
     std::cout << "Usage: bvh_extractor [options]\n"
                  "Available options:\n"
                  "  -obj     --obj-file        Sets the OBJ file to use\n"
-                 "  -o       --output          Sets the output file name\n";
+                 "  -o       --output          Sets the output file name\n"
+                 "  -q       --quantized       Also writes a BVH8 with quantized bounds (requires Embree)\n";
 }
 
 int main(int argc, char** argv) {
     std::string obj_file, out_file;
+    bool quantized = false;
     for (int i = 1; i < argc; i++) {
         auto arg = argv[i];
         if (arg[0] == '-') {
@@ -41,6 +44,8 @@ int main(int argc, char** argv) {
             } else if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
                 check_argument(i, argc, argv);
                 out_file = argv[++i];
+            } else if (!strcmp(arg, "-q") || !strcmp(arg, "--quantized")) {
+                quantized = true;
             } else {
                 std::cerr << "Unknown option '" << arg << "'" << std::endl;
                 return 1;
@@ -80,13 +85,18 @@ int main(int argc, char** argv) {
     out.write((char*)&magic, sizeof(uint32_t));
 
 #ifdef ENABLE_EMBREE_BVH
-    auto bvh8_nodes = build_bvh8(out, tri_mesh);
+    auto bvh8_nodes = build_bvh8(out, tri_mesh, quantized);
     if (!bvh8_nodes) {
         std::cerr << "Cannot build a BVH8 using Embree" << std::endl;
         return 1;
     }
 
-    std::cout << "BVH8 successfully built (" << bvh8_nodes << " nodes)" << std::endl;
+    std::cout << "BVH8 successfully built (" << bvh8_nodes << " nodes, "
+              << bvh8_nodes * sizeof(Node8) / 1024 << " KB)" << std::endl;
+    if (quantized) {
+        std::cout << "Quantized BVH8 successfully built (" << bvh8_nodes << " nodes, "
+                  << bvh8_nodes * sizeof(Node8Q) / 1024 << " KB)" << std::endl;
+    }
 
     auto bvh4_nodes = build_bvh4(out, tri_mesh);
     if (!bvh4_nodes) {
@@ -97,6 +107,8 @@ int main(int argc, char** argv) {
     std::cout << "BVH4 successfully built (" << bvh4_nodes << " nodes)" << std::endl;
 #else
     std::cout << "Compiled without Embree. Will only build a GPU BVH." << std::endl;
+    if (quantized)
+        std::cerr << "Quantized BVHs require Embree, option '--quantized' ignored" << std::endl;
 #endif
 
     auto bvh2_nodes = build_bvh2(out, tri_mesh);
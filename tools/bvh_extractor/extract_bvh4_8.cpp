@@ -4,14 +4,15 @@
 #include "traversal.h"
 #include "load_bvh.h"
 #include "runtime/embree_bvh.h"
+#include "runtime/bvh.h"
 #include "runtime/obj.h"
 
-template <size_t N, typename BvhNode, typename BvhTri>
-void write_embree_bvh(std::ofstream& out, const std::vector<BvhNode>& nodes, const std::vector<BvhTri>& tris) {
+template <typename BvhNode, typename BvhTri>
+void write_embree_bvh(std::ofstream& out, BvhType type, const std::vector<BvhNode>& nodes, const std::vector<BvhTri>& tris) {
     uint64_t offset = sizeof(uint32_t) * 3 +
         sizeof(BvhNode) * nodes.size() +
         sizeof(BvhTri)  * tris.size();
-    uint32_t block_type = uint32_t(N == 4 ? BvhType::BVH4_TRI4 : BvhType::BVH8_TRI4);
+    uint32_t block_type = uint32_t(type);
     uint32_t num_nodes = nodes.size();
     uint32_t num_tris  = tris.size();
 
@@ -28,15 +29,24 @@ size_t build_bvh4(std::ofstream& out, const mesh::TriMesh& tri_mesh) {
     std::vector<Tri4> tris;
     if (!build_embree_bvh<4>(tri_mesh, nodes, tris))
         return 0;
-    write_embree_bvh<4>(out, nodes, tris);
+    write_embree_bvh(out, BvhType::BVH4_TRI4, nodes, tris);
     return nodes.size();
 }
 
-size_t build_bvh8(std::ofstream& out, const mesh::TriMesh& tri_mesh) {
+size_t build_bvh8(std::ofstream& out, const mesh::TriMesh& tri_mesh, bool quantized) {
     std::vector<Node8> nodes;
     std::vector<Tri4> tris;
     if (!build_embree_bvh<8>(tri_mesh, nodes, tris))
         return 0;
-    write_embree_bvh<8>(out, nodes, tris);
+    write_embree_bvh(out, BvhType::BVH8_TRI4, nodes, tris);
+
+    if (quantized) {
+        // The compressed BVH has the same topology and triangles. The triangles are written again,
+        // so that every block of the file can be loaded on its own
+        std::vector<Node8Q> qnodes(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i)
+            quantize_bvh_node<8>(nodes[i], qnodes[i]);
+        write_embree_bvh(out, BvhType::BVH8Q_TRI4, qnodes, tris);
+    }
     return nodes.size();
 }
@@ -8,7 +8,8 @@
 enum class BvhType : uint32_t {
     BVH2_TRI1 = 1,
     BVH4_TRI4 = 2,
-    BVH8_TRI4 = 3
+    BVH8_TRI4 = 3,
+    BVH8Q_TRI4 = 4
 };
 
 namespace detail {